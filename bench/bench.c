@@ -0,0 +1,168 @@
+#include "../include/aabb.h"
+#include "../include/octree.h"
+#include "../include/query.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BENCH_OBJECTS (100000)
+#define BENCH_WIDTH (512)
+#define BENCH_HEIGHT (512)
+
+// relative difference two hit distances may have and still agree
+#define BENCH_TOLERANCE (1e-5)
+
+static double
+bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static float
+bench_random(float scale)
+{
+	return random() / (float) RAND_MAX * scale;
+}
+
+/*
+ * Hits agree when their distances do, within rounding. Different
+ * handles only count at different distances, since boxes entered at
+ * the same point are ties either search may report.
+ */
+static int
+bench_same_hit(octree_hit_t a, octree_hit_t b)
+{
+	if (a.t == b.t) {
+		return 1;
+	}
+	return a.handle == b.handle
+		&& fabsf(a.t - b.t) <= BENCH_TOLERANCE * fmaxf(1.0, fmaxf(fabsf(a.t), fabsf(b.t)));
+}
+
+/*
+ * A pinhole camera sweep over the same scene the visualisation fills,
+ * row by row, so consecutive rays are neighbouring pixels.
+ */
+static ray_t *
+bench_rays(size_t width, size_t height)
+{
+	size_t x, y;
+	ray_t *rays;
+	vec3_t from = ll_vec3_create3f(700.0, 300.0, -400.0),
+		to = ll_vec3_create3f(250.0, 250.0, 250.0);
+	vec3_t forward, right, up;
+
+	rays = malloc(width * height * sizeof(*rays));
+	if (!rays) return NULL;
+
+	forward = ll_vec3_normalise3fv(ll_vec3_sub3fv(to, from));
+	right = ll_vec3_normalise3fv(ll_vec3_cross3fv(forward, ll_vec3_create3f(0.0, 1.0, 0.0)));
+	up = ll_vec3_cross3fv(right, forward);
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			float u = (x + 0.5) / width - 0.5, v = (y + 0.5) / height - 0.5;
+			vec3_t direction = ll_vec3_add3fv(forward,
+				ll_vec3_add3fv(ll_vec3_mul1f(right, u), ll_vec3_mul1f(up, v)));
+			rays[y * width + x] = ray_create(from, direction);
+		}
+	}
+	return rays;
+}
+
+int
+main(int argc, char **argv)
+{
+	int threads;
+	size_t i, n, objects, found = 0, mismatches = 0;
+	double start, scalar, batch;
+	ray_t *rays;
+	aabb_t *boxes;
+	octree_t *octree;
+	octree_hit_t hit, *hits;
+	query_t *queries;
+	query_result_t *results;
+
+	objects = argc > 1 ? strtoul(argv[1], NULL, 10) : BENCH_OBJECTS;
+	boxes = malloc(objects * sizeof(*boxes));
+	if (!boxes) {
+		fprintf(stderr, "bench: out of memory\n");
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < objects; i++) {
+		float a = bench_random(450.0), b = bench_random(450.0), c = bench_random(450.0);
+		boxes[i] = (aabb_t) {
+			{{ a, b, c }},
+			{{ a + bench_random(30.0) + 10.0,
+			   b + bench_random(30.0) + 10.0,
+			   c + bench_random(30.0) + 10.0 }}
+		};
+	}
+	octree = octree_build(boxes, objects, (aabb_t) {
+			{{ 0.0, 0.0, 0.0 }},
+			{{ 500.0, 500.0, 500.0 }}
+		}, 0, NULL);
+	free(boxes);
+	if (!octree) {
+		fprintf(stderr, "bench: failed to build the octree\n");
+		return EXIT_FAILURE;
+	}
+
+	n = BENCH_WIDTH * BENCH_HEIGHT;
+	rays = bench_rays(BENCH_WIDTH, BENCH_HEIGHT);
+	hits = malloc(n * sizeof(*hits));
+	if (!rays || !hits) {
+		fprintf(stderr, "bench: out of memory\n");
+		return EXIT_FAILURE;
+	}
+
+	start = bench_now();
+	for (i = 0; i < n; i++) {
+		found += octree_find(octree, rays[i], &hit);
+	}
+	scalar = bench_now() - start;
+
+	start = bench_now();
+	octree_find_batch(octree, rays, n, hits);
+	batch = bench_now() - start;
+
+	for (i = 0; i < n; i++) {
+		octree_find(octree, rays[i], &hit);
+		mismatches += !bench_same_hit(hit, hits[i]);
+	}
+
+	printf("%zu objects, %zu rays, %zu hits\n", objects, n, found);
+	printf("octree_find:       %12.0f rays/s\n", n / scalar);
+	printf("octree_find_batch: %12.0f rays/s (%zu packets of %d, %zu mismatches)\n",
+	       n / batch, (n + RAY_PACKET_SIZE - 1) / RAY_PACKET_SIZE, RAY_PACKET_SIZE, mismatches);
+
+	queries = malloc(n * sizeof(*queries));
+	results = malloc(n * sizeof(*results));
+	if (!queries || !results) {
+		fprintf(stderr, "bench: out of memory\n");
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < n; i++) {
+		queries[i].type = QUERY_RAY;
+		queries[i].ray = rays[i];
+	}
+
+	for (threads = 1; threads <= parallel_threads(); threads *= 2) {
+		query_executor_t *executor = query_executor_create(threads);
+		if (!executor) break;
+		start = bench_now();
+		query_executor_run(executor, octree, queries, n, results);
+		printf("query_executor %2d: %12.0f rays/s\n", threads, n / (bench_now() - start));
+		query_executor_free(executor);
+	}
+
+	free(results);
+	free(queries);
+	free(hits);
+	free(rays);
+	octree_free(octree);
+	return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
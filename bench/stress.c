@@ -0,0 +1,317 @@
+#include "../include/aabb.h"
+#include "../include/octree.h"
+
+#include <math.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define STRESS_OBJECTS (200000)
+#define STRESS_THREADS (8)
+#define STRESS_RAYS (100)
+#define STRESS_READERS (3)
+
+typedef struct stress_t {
+	octree_t *octree;
+	const aabb_t *boxes;
+	octree_handle_t *handles;
+	size_t n;
+	int threads;
+	int thread;
+} stress_t;
+
+typedef struct stress_snapshot_t {
+	octree_snapshot_t *snapshot;
+	const aabb_t *boxes;
+	aabb_t aabb;
+	int done;
+	size_t errors[STRESS_READERS];
+	size_t reads[STRESS_READERS];
+	int reader;
+} stress_snapshot_t;
+
+static float
+stress_random(unsigned *seed, float scale)
+{
+	return rand_r(seed) / (float) RAND_MAX * scale;
+}
+
+// thread @thread inserts every @threads-th box, so all threads split the same leaves
+static void *
+stress_insert(void *arg)
+{
+	size_t i;
+	stress_t *stress = arg;
+	for (i = stress->thread; i < stress->n; i += stress->threads) {
+		stress->handles[i] = octree_insert_concurrent(stress->octree, stress->boxes[i],
+							      (void *) (uintptr_t) i);
+	}
+	return NULL;
+}
+
+// objects stored below the root must lie within their node's loose bounds
+static size_t
+stress_misplaced(octree_t *octree)
+{
+	int i;
+	uint32_t j;
+	size_t misplaced = 0;
+	aabb_t bounds = octree_loose_bounds(octree);
+
+	for (j = 0; octree->parent && j < octree->objects.size; j++) {
+		aabb_t aabb = octree_get(octree, OCTREE_OBJECTS_HANDLES(&octree->objects)[j]);
+		for (i = 0; i < 3; i++) {
+			if (aabb.min.data[i] < bounds.min.data[i] || aabb.max.data[i] > bounds.max.data[i]) {
+				misplaced++;
+				break;
+			}
+		}
+	}
+	for (i = 0; i < OCTREE_CHILDREN; i++) {
+		if (octree->children[i]) misplaced += stress_misplaced(octree->children[i]);
+	}
+	return misplaced;
+}
+
+/*
+ * Pins a version at a time and checks it stays put while pinned: the
+ * count is the same before and after a batch of rays, and every hit
+ * reads back the box inserted under its handle at the distance the
+ * ray meets it.
+ */
+static void *
+stress_snapshot_read(void *arg)
+{
+	int i, reader;
+	stress_snapshot_t *stress = arg;
+	int index = __atomic_fetch_add(&stress->reader, 1, __ATOMIC_RELAXED);
+	unsigned seed = index + 1;
+
+	if ((reader = octree_snapshot_reader(stress->snapshot)) < 0) {
+		stress->errors[index]++;
+		return NULL;
+	}
+	while (!__atomic_load_n(&stress->done, __ATOMIC_ACQUIRE)) {
+		octree_t *root = octree_snapshot_enter(stress->snapshot, reader);
+		size_t count = octree_count_aabb(root, stress->aabb);
+		for (i = 0; i < STRESS_RAYS; i++) {
+			octree_hit_t hit;
+			ray_t ray = ray_create(ll_vec3_create3f(stress_random(&seed, 500.0),
+								stress_random(&seed, 500.0), -10.0),
+					       ll_vec3_create3f(0.0, 0.0, 1.0));
+			if (octree_find(root, ray, &hit)) {
+				aabb_t aabb = octree_snapshot_get(stress->snapshot, hit.handle);
+				vec2_t intersect = aabb_ray_intersect(ray, stress->boxes[hit.handle]);
+				stress->errors[index] += memcmp(&aabb, stress->boxes + hit.handle, sizeof(aabb)) != 0
+					|| intersect.x != hit.t;
+			}
+		}
+		stress->errors[index] += octree_count_aabb(root, stress->aabb) != count;
+		stress->reads[index]++;
+		octree_snapshot_leave(stress->snapshot, reader);
+	}
+	octree_snapshot_reader_release(stress->snapshot, reader);
+	return NULL;
+}
+
+/*
+ * One writer inserts the boxes into a snapshot tree, removing a random
+ * live object after every other insert, while STRESS_READERS readers
+ * query it. The final version must hold exactly the live objects.
+ */
+static size_t
+stress_snapshot_run(const aabb_t *boxes, size_t n, aabb_t aabb, size_t *reads)
+{
+	int t;
+	size_t i, live = 0, errors = 0;
+	unsigned seed = 1;
+	unsigned char *removed;
+	octree_t *root;
+	stress_snapshot_t stress = { 0 };
+	pthread_t readers[STRESS_READERS];
+
+	stress.snapshot = octree_snapshot_create(aabb, 1.2);
+	stress.boxes = boxes;
+	stress.aabb = aabb;
+	removed = calloc(n, 1);
+	if (!stress.snapshot || !removed) {
+		fprintf(stderr, "stress: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (t = 0; t < STRESS_READERS; t++) {
+		if (pthread_create(readers + t, NULL, stress_snapshot_read, &stress) != 0) {
+			fprintf(stderr, "stress: cannot start reader %d\n", t);
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (i = 0; i < n; i++) {
+		errors += octree_snapshot_insert(stress.snapshot, boxes[i]) != i;
+		live++;
+		if (i % 2 == 1) {
+			size_t victim = (size_t) stress_random(&seed, i);
+			if (!removed[victim]) {
+				errors += octree_snapshot_remove(stress.snapshot, victim) != 0;
+				removed[victim] = 1;
+				live--;
+			}
+		}
+	}
+	__atomic_store_n(&stress.done, 1, __ATOMIC_RELEASE);
+
+	for (t = 0; t < STRESS_READERS; t++) {
+		pthread_join(readers[t], NULL);
+	}
+	*reads = 0;
+	for (t = 0; t < STRESS_READERS; t++) {
+		errors += stress.errors[t];
+		*reads += stress.reads[t];
+	}
+
+	t = octree_snapshot_reader(stress.snapshot);
+	root = octree_snapshot_enter(stress.snapshot, t);
+	errors += octree_count_aabb(root, aabb) != live;
+	octree_snapshot_leave(stress.snapshot, t);
+	octree_snapshot_reader_release(stress.snapshot, t);
+
+	octree_snapshot_free(stress.snapshot);
+	free(removed);
+	return errors;
+}
+
+/*
+ * Inserts the boxes from @threads threads at once and checks the tree
+ * against them: every handle unique and reading back its box and
+ * data, the object count right, every object inside its node and rays
+ * finding what a brute force search finds.
+ */
+static size_t
+stress_run(const aabb_t *boxes, size_t n, const octree_config_t *config, int threads,
+	   arena_t *arena)
+{
+	int t;
+	size_t i, j, errors = 0;
+	unsigned seed = threads;
+	unsigned char *seen;
+	octree_handle_t *handles;
+	octree_memory_t memory = {0};
+	stress_t stress[STRESS_THREADS];
+	pthread_t workers[STRESS_THREADS];
+	octree_t *octree;
+
+	octree = octree_create_config(config, arena);
+	handles = malloc(n * sizeof(*handles));
+	seen = calloc(n, 1);
+	if (!octree || !handles || !seen) {
+		fprintf(stderr, "stress: out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (t = 0; t < threads; t++) {
+		stress[t] = (stress_t) { octree, boxes, handles, n, threads, t };
+		if (pthread_create(workers + t, NULL, stress_insert, stress + t) != 0) {
+			fprintf(stderr, "stress: cannot start thread %d\n", t);
+			exit(EXIT_FAILURE);
+		}
+	}
+	for (t = 0; t < threads; t++) {
+		pthread_join(workers[t], NULL);
+	}
+
+	for (i = 0; i < n; i++) {
+		aabb_t aabb;
+		if (handles[i] >= n || seen[handles[i]]) {
+			errors++;
+			continue;
+		}
+		seen[handles[i]] = 1;
+		aabb = octree_get(octree, handles[i]);
+		if (memcmp(&aabb, boxes + i, sizeof(aabb)) != 0
+		    || octree_data(octree, handles[i]) != (void *) (uintptr_t) i) {
+			errors++;
+		}
+	}
+
+	octree_memory(octree, &memory);
+	errors += memory.objects != n;
+	errors += stress_misplaced(octree);
+
+	for (i = 0; i < STRESS_RAYS; i++) {
+		float best = INFINITY;
+		octree_hit_t hit;
+		const aabb_t *target = boxes + (size_t) stress_random(&seed, n - 1);
+		ray_t ray = ray_create(ll_vec3_create3f((target->min.x + target->max.x) / 2.0,
+							(target->min.y + target->max.y) / 2.0, -10.0),
+				       ll_vec3_create3f(0.0, 0.0, 1.0));
+		for (j = 0; j < n; j++) {
+			vec2_t intersect = aabb_ray_intersect(ray, boxes[j]);
+			if (intersect.x <= intersect.y && intersect.x < best) {
+				best = intersect.x;
+			}
+		}
+		errors += !octree_find(octree, ray, &hit) || hit.t != best;
+	}
+
+	octree_free(octree);
+	free(seen);
+	free(handles);
+	return errors;
+}
+
+int
+main(int argc, char **argv)
+{
+	int threads, split, looseness;
+	size_t i, n, reads, found, errors = 0;
+	unsigned seed = 1;
+	aabb_t *boxes;
+	aabb_t aabb = { {{0.0, 0.0, 0.0}}, {{500.0, 500.0, 500.0}} };
+
+	n = argc > 1 ? strtoul(argv[1], NULL, 10) : STRESS_OBJECTS;
+	boxes = malloc(n * sizeof(*boxes));
+	if (n == 0 || !boxes) {
+		fprintf(stderr, "stress: out of memory\n");
+		return EXIT_FAILURE;
+	}
+	for (i = 0; i < n; i++) {
+		float x = stress_random(&seed, 450.0), y = stress_random(&seed, 450.0),
+			z = stress_random(&seed, 450.0);
+		boxes[i] = (aabb_t) {
+			{{x, y, z}},
+			{{x + stress_random(&seed, 3.0) + 0.1, y + stress_random(&seed, 3.0) + 0.1,
+			  z + stress_random(&seed, 3.0) + 0.1}}
+		};
+	}
+
+	// small splits and a tight fit split leaves the most while threads race on
+	// them, and the loose runs allocate from an arena behind the state lock
+	for (threads = 1; threads <= STRESS_THREADS; threads++) {
+		for (split = 1; split <= OCTREE_DEFAULT_SPLIT; split *= 4) {
+			for (looseness = 0; looseness < 2; looseness++) {
+				arena_t *arena = looseness ? arena_create(0) : NULL;
+				octree_config_t config = octree_config_default(aabb);
+				config.split = split;
+				config.looseness = looseness ? 1.2 : 1.0;
+
+				found = stress_run(boxes, n, &config, threads, arena);
+				if (arena && arena_used(arena) != 0) {
+					found++;
+				}
+				printf("threads %d split %2d looseness %.1f arena %d: %zu errors\n",
+				       threads, split, config.looseness, arena != NULL, found);
+				errors += found;
+				arena_free(arena);
+			}
+		}
+	}
+
+	found = stress_snapshot_run(boxes, n, aabb, &reads);
+	printf("snapshot readers %d reads %zu: %zu errors\n", STRESS_READERS, reads, found);
+	errors += found;
+
+	free(boxes);
+	return errors ? EXIT_FAILURE : EXIT_SUCCESS;
+}
@@ -26,13 +26,47 @@ aabbs_init(void);
 extern aabb_t
 aabb_empty(void);
 
+// how far aabb_contains() lets @b stick out of @a
+#define AABB_CONTAINS_SLACK (0.001)
+
 extern int
 aabb_contains(aabb_t a, aabb_t b);
 
+extern int
+aabb_overlaps(aabb_t a, aabb_t b);
+
+/*
+ * @description Squared distances from @point to the nearest and the
+ * farthest point of @aabb; the nearest is 0 when @point is inside.
+ */
+extern float
+aabb_distance2(aabb_t aabb, vec3_t point);
+
+extern float
+aabb_farthest2(aabb_t aabb, vec3_t point);
+
 extern vec2_t
 aabb_ray_intersect(ray_t ray, aabb_t aabb);
 
 extern int
 aabb_ray_hit(ray_t ray, aabb_t aabb);
 
+/*
+ * @description Tests @ray against @n boxes stored as six arrays
+ * @stride floats apart: min x, y, z then max x, y, z. Finds the box
+ * with the smallest entry distance below *@t, several boxes at a time
+ * with SSE or AVX when available.
+ * @return The index of that box with its distance stored in @t, or -1.
+ */
+extern long
+aabb_ray_nearest(ray_t ray, const float *soa, size_t stride, size_t n, float *t);
+
+/*
+ * @description Tests every lane of @packet set in @mask against @aabb,
+ * storing each lane's entry distance in @entry.
+ * @return The mask of lanes that hit @aabb closer than their packet t.
+ */
+extern int
+aabb_ray_packet(const ray_packet_t *packet, aabb_t aabb, int mask, float *entry);
+
 #endif /* AABB_H_ */
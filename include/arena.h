@@ -0,0 +1,73 @@
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stddef.h>
+
+/*
+ * Allocations are rounded up to a power of two between
+ * ARENA_MINIMUM_BLOCK and the slab size, and carved out of large
+ * contiguous slabs. Released blocks go on a free list for their size
+ * class and are handed out again before the slab grows. Requests
+ * larger than a slab get a dedicated chunk that is still owned by the
+ * arena, so arena_reset() and arena_free() release everything at once.
+ */
+#define ARENA_MINIMUM_BLOCK (16)
+#define ARENA_DEFAULT_SLAB (1 << 20)
+#define ARENA_CLASSES (32)
+
+typedef struct arena_slab_t {
+	struct arena_slab_t *next;
+	size_t size;
+} arena_slab_t;
+
+typedef struct arena_chunk_t {
+	struct arena_chunk_t *next;
+	struct arena_chunk_t *prev;
+	size_t size;
+} arena_chunk_t;
+
+typedef struct arena_t {
+	size_t slab_size;
+	arena_slab_t *slabs;        /* every slab ever reserved, oldest first */
+	arena_slab_t *current;      /* the slab being bumped from */
+	size_t offset;              /* bump offset into @current */
+	void *free_lists[ARENA_CLASSES];
+	arena_chunk_t *chunks;      /* oversized allocations */
+	size_t reserved;
+	size_t used;
+} arena_t;
+
+/*
+ * @description Creates an empty arena, @slab_size of 0 selects
+ * ARENA_DEFAULT_SLAB. Nothing is reserved until the first allocation.
+ */
+extern arena_t *
+arena_create(size_t slab_size);
+
+extern void *
+arena_alloc(arena_t *arena, size_t size);
+
+/*
+ * @description Returns @ptr to the arena, @size must be the size it
+ * was allocated with.
+ */
+extern void
+arena_release(arena_t *arena, void *ptr, size_t size);
+
+/*
+ * @description Forgets every allocation while keeping the slabs
+ * reserved for reuse. Cost does not depend on the number of blocks.
+ */
+extern void
+arena_reset(arena_t *arena);
+
+extern void
+arena_free(arena_t *arena);
+
+extern size_t
+arena_reserved(const arena_t *arena);
+
+extern size_t
+arena_used(const arena_t *arena);
+
+#endif /* ARENA_H_ */
@@ -0,0 +1,49 @@
+#ifndef FRUSTUM_H_
+#define FRUSTUM_H_
+
+#include "linear.h"
+#include "aabb.h"
+
+/*
+ * A convex volume bounded by planes (x, y, z, w) whose normals point
+ * inwards: a point p is inside a plane when x*p.x + y*p.y + z*p.z + w
+ * is not negative.
+ */
+#define FRUSTUM_PLANES (6)
+#define FRUSTUM_MASK_ALL ((1 << FRUSTUM_PLANES) - 1)
+
+typedef enum frustum_side_t {
+	FRUSTUM_OUTSIDE,
+	FRUSTUM_INTERSECT,
+	FRUSTUM_INSIDE
+} frustum_side_t;
+
+typedef struct frustum_t {
+	vec4_t planes[FRUSTUM_PLANES];
+} frustum_t;
+
+/*
+ * @description Extracts the planes of the volume @projection sees
+ * through @view, with both matrices laid out as ll_matrices holds them
+ * (points multiply on the left, translation in the bottom row).
+ */
+extern frustum_t
+frustum_create(mat4_t view, mat4_t projection);
+
+/*
+ * @description Classifies @aabb against @frustum. A box is only
+ * reported outside when a single plane rejects all of it, so a box near
+ * a corner of the frustum may be reported as intersecting it.
+ */
+extern frustum_side_t
+frustum_aabb(const frustum_t *frustum, aabb_t aabb);
+
+/*
+ * @description As frustum_aabb(), but only tests the planes set in
+ * *@mask and clears the bits of planes @aabb lies fully inside. Passing
+ * the result on to boxes inside @aabb lets them skip those planes.
+ */
+extern frustum_side_t
+frustum_aabb_masked(const frustum_t *frustum, aabb_t aabb, int *mask);
+
+#endif /* FRUSTUM_H_ */
@@ -0,0 +1,70 @@
+#ifndef LOADER_H_
+#define LOADER_H_
+
+#include <stddef.h>
+#include <stdio.h>
+#include "aabb.h"
+#include "octree.h"
+
+/*
+ * Streams boxes from a file into an octree without ever holding the
+ * file in memory. One thread reads and parses fixed size chunks while
+ * the others insert finished chunks with octree_insert_concurrent(),
+ * and only a few chunks are in flight at a time, so the loader's own
+ * memory stays the same however large the file is.
+ *
+ * A binary file is a packed array of six native floats per box: min
+ * x, y, z then max x, y, z. A CSV file has the same six values per
+ * line; lines that do not parse as a box, such as a header, are
+ * counted and skipped.
+ */
+#define LOADER_READ_BYTES (1 << 20)
+#define LOADER_CHUNK_BOXES (1 << 15)
+
+typedef enum loader_format_t {
+	LOADER_BINARY,
+	LOADER_CSV
+} loader_format_t;
+
+typedef struct loader_stats_t {
+	size_t rows;            /* boxes inserted so far */
+	size_t rejected;        /* rows that were not a valid box */
+	size_t bytes;           /* bytes read so far */
+	size_t total;           /* size of the file, 0 when unknown */
+	double seconds;
+} loader_stats_t;
+
+/*
+ * @description Called from the parsing thread after every chunk and
+ * once more when the load finishes.
+ */
+typedef void (*loader_progress_t)(const loader_stats_t *stats, void *arg);
+
+/*
+ * @description Guesses the format of @path from its extension, ".csv"
+ * being CSV and anything else binary.
+ */
+extern loader_format_t
+loader_format(const char *path);
+
+/*
+ * @description Inserts every box in @path into @octree using
+ * @threads inserting threads beside the parsing one, 0 meaning one per
+ * online core. Handles follow no particular order when more than one
+ * thread inserts. @progress may be NULL; @stats, when not NULL,
+ * receives the final counts.
+ * @return 0 on success, -1 when the file cannot be read or an insert
+ * fails, in which case the boxes inserted so far stay in the tree.
+ */
+extern int
+loader_load(octree_t *octree, const char *path, loader_format_t format, int threads,
+	    loader_progress_t progress, void *arg, loader_stats_t *stats);
+
+/*
+ * @description A loader_progress_t that writes rows, percentage and
+ * rows per second to the FILE * passed as @arg on a single line.
+ */
+extern void
+loader_progress_print(const loader_stats_t *stats, void *arg);
+
+#endif /* LOADER_H_ */
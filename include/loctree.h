@@ -0,0 +1,56 @@
+#ifndef LOCTREE_H_
+#define LOCTREE_H_
+
+#include <stddef.h>
+#include "aabb.h"
+#include "morton.h"
+#include "octree.h"
+
+/*
+ * A pointerless octree. Every object is tagged with the locational
+ * code of the deepest cell that contains it and kept in flat arrays
+ * sorted by morton_compare(), so a cell and everything below it is one
+ * contiguous range and nodes only exist implicitly as code prefixes.
+ * Inserts are appended and merged into the sorted range on the next
+ * query. Handles are assigned in insertion order and also index the
+ * data payloads, which are not moved when the arrays are sorted.
+ */
+#define LOCTREE_DEFAULT_DEPTH (MORTON_MAXIMUM_DEPTH)
+
+typedef struct loctree_t {
+	aabb_t aabb;
+	int depth;
+	size_t size;
+	size_t sorted;       /* leading entries that are in order */
+	size_t capacity;
+	morton_t *codes;
+	aabb_t *objects;
+	octree_handle_t *handles;
+	void **data;         /* by handle */
+} loctree_t;
+
+extern loctree_t *
+loctree_create(aabb_t aabb);
+
+/*
+ * @description Adds @aabb with the payload @data. Boxes that reach
+ * outside the root are kept at the root, as octree_insert() does, and
+ * are tested by every query.
+ * @return The new handle, or OCTREE_HANDLE_NONE when out of memory.
+ */
+extern octree_handle_t
+loctree_insert(loctree_t *loctree, aabb_t aabb, void *data);
+
+extern void *
+loctree_data(loctree_t *loctree, octree_handle_t handle);
+
+extern void
+loctree_set_data(loctree_t *loctree, octree_handle_t handle, void *data);
+
+extern int
+loctree_find(loctree_t *loctree, ray_t ray, octree_hit_t *hit);
+
+extern void
+loctree_free(loctree_t *loctree);
+
+#endif /* LOCTREE_H_ */
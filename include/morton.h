@@ -0,0 +1,65 @@
+#ifndef MORTON_H_
+#define MORTON_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "aabb.h"
+
+/*
+ * Locational codes: a sentinel 1 bit followed by three bits per level,
+ * x in the lowest bit of each triple, a set bit selecting the upper
+ * half along that axis. The root is 1, its children 8..15 and so on,
+ * which fits 21 levels in 64 bits.
+ */
+#define MORTON_MAXIMUM_DEPTH (21)
+#define MORTON_ROOT ((morton_t) 1)
+
+typedef uint64_t morton_t;
+
+extern uint64_t
+morton_encode(uint32_t x, uint32_t y, uint32_t z);
+
+extern void
+morton_decode(uint64_t code, uint32_t *x, uint32_t *y, uint32_t *z);
+
+/*
+ * @description Returns the code of the deepest cell, no deeper than
+ * @depth, of the grid over @bounds whose morton_bounds() fully
+ * contain @aabb, or 0 when @aabb does not lie inside @bounds.
+ */
+extern morton_t
+morton_cell(aabb_t bounds, aabb_t aabb, int depth);
+
+extern int
+morton_depth(morton_t code);
+
+/*
+ * @description Returns @code left aligned to MORTON_MAXIMUM_DEPTH, so
+ * that every cell below @code has a key in
+ * [morton_key(code), morton_key(code) + morton_span(code)).
+ */
+extern uint64_t
+morton_key(morton_t code);
+
+extern uint64_t
+morton_span(morton_t code);
+
+/*
+ * @description Orders codes by key and then depth, which places every
+ * cell directly before its descendants.
+ */
+extern int
+morton_compare(morton_t a, morton_t b);
+
+extern aabb_t
+morton_bounds(aabb_t bounds, morton_t code);
+
+/*
+ * @description Sorts @values ascending on their low @bits bits with an
+ * LSD radix sort spread over @threads threads (0 for every core),
+ * applying the same permutation to @index.
+ */
+extern int
+morton_sort(uint64_t *values, uint32_t *index, size_t n, int bits, int threads);
+
+#endif /* MORTON_H_ */
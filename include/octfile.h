@@ -0,0 +1,114 @@
+#ifndef OCTFILE_H_
+#define OCTFILE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "aabb.h"
+#include "octree.h"
+
+/*
+ * A read-only octree laid out for mmap. Everything is addressed by
+ * index or byte offset from the start of the file, never by pointer,
+ * so a mapping can be queried in place at any address and shared by
+ * several processes through the page cache.
+ *
+ * The file holds a header, the nodes in breadth first order, then the
+ * objects of every node back to back as seven arrays of @nobjects
+ * entries: min x, y, z, max x, y, z and the handles, 28 bytes per
+ * object.
+ *
+ * Nodes store no bounds; a child's cell follows from its parent's and
+ * its octant with octree_quadrant(). Breadth first order puts the
+ * children of a node next to each other, so a node only needs a mask
+ * of the octants it has children in and the index of the first child,
+ * the k-th set bit of the mask being child + k. The checksum covers
+ * every byte after the header.
+ */
+#define OCTFILE_MAGIC (0x4f435452)   /* "OCTR" */
+#define OCTFILE_VERSION (2)
+#define OCTFILE_ALIGN (64)
+
+typedef struct octfile_header_t {
+	uint32_t magic;
+	uint32_t version;
+	uint64_t size;          /* bytes in the whole file */
+	uint64_t checksum;
+	uint64_t nodes;         /* offset of the node array */
+	uint64_t objects;       /* offset of the object arrays */
+	uint32_t nnodes;
+	uint32_t nobjects;
+	aabb_t aabb;            /* the root's cell */
+	float looseness;
+} octfile_header_t;
+
+typedef struct octfile_node_t {
+	uint32_t child;         /* index of the first child */
+	uint32_t first;         /* index of the first object */
+	uint32_t count;
+	uint8_t mask;           /* bit i set when octant i has a child */
+	uint8_t reserved[3];
+} octfile_node_t;
+
+typedef struct octfile_t {
+	void *base;
+	size_t size;
+	int mapped;             /* base is a mapping rather than allocated */
+	const octfile_header_t *header;
+	const octfile_node_t *nodes;
+	const float *objects;
+} octfile_t;
+
+/*
+ * @description Freezes @octree into the format above in memory, for
+ * trees that are done changing and only need to be queried. The result
+ * is independent of @octree, which may be freed. Object data pointers
+ * are not kept.
+ * @return The frozen tree, or NULL on failure.
+ */
+extern octfile_t *
+octree_freeze(octree_t *octree);
+
+/*
+ * @description Freezes @octree and writes it to @path.
+ * @return 0 on success, -1 on failure.
+ */
+extern int
+octree_save(octree_t *octree, const char *path);
+
+/*
+ * @description Maps @path read-only after checking its header, version,
+ * checksum and that every index stays inside the file.
+ * @return The mapped tree, or NULL when it cannot be used.
+ */
+extern octfile_t *
+octree_open_mmap(const char *path);
+
+/*
+ * @description Checks that @header describes a file of @size bytes,
+ * a multiple of 8 as the checksum reads words, whose sections fit
+ * inside it, and that @node, stored at @index,
+ * only refers to objects and children that exist, its children starting
+ * at @child. Checked over every node in order with @child one more than
+ * the children of the nodes before, as breadth first order places them,
+ * each node has exactly one parent that comes before it, so a walk from
+ * the root visits every node once. Readers also reject files deeper
+ * than OCTREE_MAXIMUM_DEPTH, which keeps their walks within OCTREE_STACK.
+ * @return 0 when usable, -1 otherwise.
+ */
+extern int
+octfile_header_check(const octfile_header_t *header, uint64_t size);
+
+extern int
+octfile_node_check(const octfile_header_t *header, const octfile_node_t *node, uint32_t index,
+		   uint32_t child);
+
+extern int
+octfile_find(const octfile_t *file, ray_t ray, octree_hit_t *hit);
+
+extern size_t
+octfile_query_aabb(const octfile_t *file, aabb_t aabb, octree_handle_t *results, size_t capacity);
+
+extern void
+octfile_close(octfile_t *file);
+
+#endif /* OCTFILE_H_ */
@@ -0,0 +1,93 @@
+#ifndef OCTPAGE_H_
+#define OCTPAGE_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include "octfile.h"
+
+/*
+ * An octfile read on demand instead of mapped whole, for trees larger
+ * than memory. The top OCTPAGE_RESIDENT_LEVELS levels of nodes are read
+ * at open and kept; everything deeper is read through a cache of
+ * fixed size pages of the file, evicting the least recently used page
+ * once @budget bytes are held.
+ *
+ * Nodes are in breadth first order and objects follow their nodes, so
+ * the children of a node, and their boxes, are each one contiguous
+ * range of the file. Before descending, the boxes of every child the
+ * ray or region reaches are prefetched with a single read-ahead hint
+ * per array, so the kernel fetches the siblings while the nearest one
+ * is searched.
+ *
+ * Opening does not verify the checksum, which would read the whole
+ * file, but it does check the node array once in order, as
+ * octree_open_mmap() does, without keeping more than the resident
+ * levels. Nodes and objects read later are bounds checked again as
+ * they are read. A paged tree is not safe to use from several threads
+ * at once.
+ */
+#define OCTPAGE_SIZE (64 * 1024)
+#define OCTPAGE_RESIDENT_LEVELS (4)
+
+// nodes read at a time while checking the node array at open
+#define OCTPAGE_CHECK (4096)
+
+typedef struct octpage_stats_t {
+	size_t hits;
+	size_t misses;
+	size_t bytes;           /* read from the file */
+	size_t prefetches;      /* read-ahead hints issued */
+	size_t evictions;
+} octpage_stats_t;
+
+typedef struct octpage_entry_t {
+	uint64_t page;
+	int prev;               /* towards the most recently used */
+	int next;
+	size_t size;
+	unsigned char *data;
+} octpage_entry_t;
+
+typedef struct octpage_t {
+	int fd;
+	octfile_header_t header;
+	octfile_node_t *resident;
+	uint32_t nresident;
+	int *slots;             /* cache entry of every page, or -1 */
+	octpage_entry_t *entries;
+	int nentries, entries_capacity;
+	int head, tail;         /* most and least recently used */
+	unsigned char *scratch; /* boxes of the node being searched */
+	size_t scratch_capacity;
+	octpage_stats_t stats;
+} octpage_t;
+
+/*
+ * @description Opens the octfile at @path for paged reads, caching at
+ * most @budget bytes of it, rounded down to whole pages but never
+ * less than one page.
+ * @return The paged tree, or NULL when the file cannot be used.
+ */
+extern octpage_t *
+octree_open_paged(const char *path, size_t budget);
+
+/*
+ * @return 1 on a hit, 0 on a miss and -1 when the file could not be
+ * read or holds a bad node.
+ */
+extern int
+octpage_find(octpage_t *pager, ray_t ray, octree_hit_t *hit);
+
+/*
+ * @description As octfile_query_aabb() with the total number of
+ * overlapping objects stored in @count.
+ * @return 0 on success, -1 when the file could not be read.
+ */
+extern int
+octpage_query_aabb(octpage_t *pager, aabb_t aabb, octree_handle_t *results, size_t capacity,
+		   size_t *count);
+
+extern void
+octpage_close(octpage_t *pager);
+
+#endif /* OCTPAGE_H_ */
@@ -2,27 +2,388 @@
 #define OCTREE_H_
 
 #include <stdio.h>
+#include <stdint.h>
 #include "linear.h"
 #include "aabb.h"
+#include "arena.h"
+#include "frustum.h"
+#include "morton.h"
 
-#define OCTREE_LAYER_CAPACITY (100)
+#define OCTREE_OBJECTS_MINIMUM (4)
 #define OCTREE_CHILDREN (8)
 
+#define OCTREE_BUILD_FIT (1 << 0)
+
+// leaves are merged back into their parent once they hold half the split threshold
+#define OCTREE_COLLAPSE_THRESHOLD(split) ((split) / 2)
+
+/*
+ * Objects stored at a node, laid out as seven arrays of @capacity
+ * entries in one block: min x, y, z and max x, y, z as floats followed
+ * by the objects' handles. A node without objects has no block at all.
+ * The handle row is only accessed through OCTREE_OBJECTS_HANDLES() or
+ * memcpy(), never as floats.
+ */
+typedef struct octree_objects_t {
+	float *data;
+	uint32_t size;
+	uint32_t capacity;
+} octree_objects_t;
+
+#define OCTREE_OBJECTS_MIN(objects, axis) ((objects)->data + (axis) * (objects)->capacity)
+#define OCTREE_OBJECTS_MAX(objects, axis) ((objects)->data + (3 + (axis)) * (objects)->capacity)
+#define OCTREE_OBJECTS_HANDLES(objects) ((octree_handle_t *) ((objects)->data + 6 * (objects)->capacity))
+
+#define OCTREE_DEFAULT_LOOSENESS (1.0)
+#define OCTREE_DEFAULT_DEPTH (10)
+#define OCTREE_DEFAULT_SPLIT (16)
+
+// the deepest tree a config may ask for, as deep as locational codes go
+#define OCTREE_MAXIMUM_DEPTH (MORTON_MAXIMUM_DEPTH)
+
+/*
+ * Traversals keep their pending nodes on a fixed stack instead of
+ * recursing. Visiting a node replaces it with at most eight children,
+ * so seven siblings wait on each level above the one being visited.
+ */
+#define OCTREE_STACK (7 * OCTREE_MAXIMUM_DEPTH + 8)
+
+/*
+ * The shape of a tree, fixed when it is created. Objects never sit more
+ * than @depth levels below the root, leaves are divided once they hold
+ * more than @split objects and @looseness is as described for
+ * octree_state_t.
+ */
+typedef struct octree_config_t {
+	aabb_t aabb;            /* bounds of the root */
+	int depth;
+	uint32_t split;
+	float looseness;
+} octree_config_t;
+
+/*
+ * Handles name one object for as long as it is stored, whichever node
+ * it moves to. They index the tree's entry table, which records where
+ * the object currently lives and the payload it was inserted with.
+ */
+typedef uint32_t octree_handle_t;
+
+#define OCTREE_HANDLE_NONE ((octree_handle_t) -1)
+
+typedef struct octree_entry_t {
+	struct octree_t *node;  /* NULL while the entry is free */
+	uint32_t slot;          /* index in @node's objects, or the next free entry */
+	void *data;
+} octree_entry_t;
+
+typedef struct octree_hit_t {
+	octree_handle_t handle;
+	float t;                /* distance along the ray to the hit */
+} octree_hit_t;
+
+typedef struct octree_pair_t {
+	octree_handle_t a;      /* always the smaller handle */
+	octree_handle_t b;
+} octree_pair_t;
+
+/*
+ * State shared by every node of one tree. With a @looseness of k a
+ * node accepts any object inside its cell scaled by k around the cell
+ * centre, so objects that move a little stay in their node.
+ */
+typedef struct octree_state_t {
+	struct octree_t *root;
+	arena_t *arena;
+	float looseness;
+	int depth;
+	uint32_t split;
+	octree_entry_t *entries;
+	uint32_t nentries;
+	uint32_t entries_capacity;
+	octree_handle_t free_entry;
+	int lock;               /* guards the arena and entries in concurrent inserts */
+} octree_state_t;
+
 typedef struct octree_t {
 	aabb_t aabb;
-	size_t size;
-	aabb_t objects[OCTREE_LAYER_CAPACITY];
+	octree_objects_t objects;
 	struct octree_t *children[OCTREE_CHILDREN];
+	struct octree_t *parent;
+	octree_state_t *state;
+	int lock;               /* guards @objects and new children in concurrent inserts */
 } octree_t;
 
+/*
+ * Single writer, many reader publication. The writer never changes a
+ * node readers can reach: every insert or remove copies the nodes on
+ * its path, links the copies to the untouched subtrees and publishes
+ * the new root with one atomic store. A reader pins the current epoch,
+ * takes the root and can run octree_find(), the region queries or
+ * octree_render() on it without locks while the writer moves on.
+ * Replaced nodes and object blocks are freed once every reader that
+ * might still see them has left.
+ *
+ * Snapshot trees keep no handle table, so octree_get() and
+ * octree_data() do not work on their roots; readers look boxes up with
+ * octree_snapshot_get(). Boxes are never changed once stored, and the
+ * array holding them is retired like a node when it grows.
+ *
+ * A snapshot root must never be passed to the live mutators such as
+ * octree_insert(), octree_remove() or octree_update(). Versions share
+ * subtrees, and the parent pointers of a shared subtree lead into the
+ * version it was first built in, whose nodes may already be retired.
+ */
+#define OCTREE_SNAPSHOT_READERS (64)
+
+typedef struct octree_snapshot_slot_t {
+	uint64_t epoch;         /* epoch pinned by the reader, 0 when idle */
+	int claimed;
+} __attribute__((aligned(64))) octree_snapshot_slot_t;
+
+typedef struct octree_retired_t {
+	void *ptr;
+	uint64_t epoch;         /* epoch it was replaced in */
+} octree_retired_t;
+
+typedef struct octree_snapshot_t {
+	octree_t *root;         /* the published version */
+	uint64_t epoch;
+	octree_snapshot_slot_t readers[OCTREE_SNAPSHOT_READERS];
+	octree_retired_t *retired;
+	size_t nretired;
+	size_t retired_capacity;
+	aabb_t *boxes;          /* every box ever inserted, by handle */
+	uint32_t nboxes;
+	uint32_t boxes_capacity;
+} octree_snapshot_t;
+
+// a render in progress, see octree_render_begin()
+typedef struct octree_render_t {
+	frustum_t frustum;
+	GLint model;
+	octree_t *stack[OCTREE_STACK];
+	int masks[OCTREE_STACK];
+	int size;
+} octree_render_t;
+
+/*
+ * A region query's traversal stack and result list, kept by callers
+ * that run many queries, see octree_query_aabb_into()
+ */
+typedef struct octree_scratch_t {
+	octree_t *stack[OCTREE_STACK];
+	unsigned char inside[OCTREE_STACK];
+	octree_handle_t *results;  /* grown with realloc(), released with free() */
+	size_t capacity;
+	size_t count;              /* matches of the last query */
+} octree_scratch_t;
+
+typedef struct octree_memory_t {
+	size_t nodes;
+	size_t objects;
+	size_t node_bytes;    /* bytes taken by the nodes themselves */
+	size_t object_bytes;  /* bytes reserved for object storage */
+	size_t entry_bytes;   /* bytes reserved for the handle table */
+} octree_memory_t;
+
+/*
+ * @description Creates an empty tree covering @aabb. When @arena is
+ * non-NULL every node, object block and the handle table of the tree
+ * are allocated from it, which keeps nodes packed together and lets
+ * the whole tree be dropped at once with arena_reset() or arena_free()
+ * instead of octree_free().
+ */
 extern octree_t *
-octree_create(aabb_t aabb);
+octree_create(aabb_t aabb, arena_t *arena);
+
+/*
+ * @description The configuration octree_create() uses for a root of
+ * @aabb.
+ */
+extern octree_config_t
+octree_config_default(aabb_t aabb);
+
+/*
+ * @description As octree_create() with the shape given by @config.
+ * @return The tree, or NULL when out of memory or when @config has a
+ * depth outside 0 to OCTREE_MAXIMUM_DEPTH, a split of 0 or a looseness
+ * below 1.
+ */
+extern octree_t *
+octree_create_config(const octree_config_t *config, arena_t *arena);
+
+/*
+ * @description Sets the looseness factor (at least 1) of an empty tree.
+ * @return 0 on success, -1 when the tree already holds objects.
+ */
+extern int
+octree_set_looseness(octree_t *octree, float looseness);
+
+/*
+ * @description Stores @aabb along with the caller's @data. Objects
+ * collect in leaves; a leaf going over the split threshold moves every
+ * object that fits one of its children down into it, while objects
+ * reaching an inner node go on into the child holding their centre.
+ * @return The object's handle, or OCTREE_HANDLE_NONE on failure.
+ */
+extern octree_handle_t
+octree_insert(octree_t *octree, aabb_t aabb, void *data);
+
+/*
+ * @description Builds a tree over @boxes in one pass: each box is
+ * tagged with the Morton code of the cell it belongs in, the codes are
+ * radix sorted and the resulting subtrees are built in parallel on
+ * every core. With OCTREE_BUILD_FIT the root is fitted to the boxes
+ * instead of using @aabb. Trees backed by @arena are built on the
+ * calling thread only. The handle of boxes[i] is i.
+ */
+extern octree_t *
+octree_build(const aabb_t *boxes, size_t n, aabb_t aabb, int flags, arena_t *arena);
+
+/*
+ * @description As octree_build() with the shape given by @config, whose
+ * bounds OCTREE_BUILD_FIT replaces.
+ */
+extern octree_t *
+octree_build_config(const aabb_t *boxes, size_t n, const octree_config_t *config, int flags,
+		    arena_t *arena);
+
+/*
+ * @description As octree_insert(), but safe to call from any number of
+ * threads at once on the same tree. Each node has a spinlock guarding
+ * its objects and the creation of its children, and existing children
+ * are followed without it, so inserts into different parts of the tree
+ * do not wait on each other. Nothing else may use the tree while
+ * concurrent inserts run.
+ */
+extern octree_handle_t
+octree_insert_concurrent(octree_t *octree, aabb_t aabb, void *data);
+
+/*
+ * @description Finds the closest object along @ray and stores it in
+ * @hit. @return 1 on a hit, 0 when the ray misses everything.
+ */
+extern int
+octree_find(octree_t *octree, ray_t ray, octree_hit_t *hit);
+
+/*
+ * @description Finds the closest object along each of @n rays, storing
+ * the result for @rays[i] in @hits[i] as octree_find() would. Rays are
+ * traversed RAY_PACKET_SIZE at a time and should be coherent, e.g.
+ * neighbouring pixels; lanes that leave their packet continue alone.
+ * @return The number of rays that hit something.
+ */
+extern size_t
+octree_find_batch(octree_t *octree, const ray_t *rays, size_t n, octree_hit_t *hits);
+
+/*
+ * @description Region queries: collect the handles of every object that
+ * overlaps @aabb, lies at least partly within @radius of @centre, or is
+ * not rejected by @frustum (see frustum_aabb()). At most @capacity
+ * handles are written to @results, in no particular order.
+ * @return The number of matching objects, which is larger than
+ * @capacity when @results was too small.
+ */
+extern size_t
+octree_query_aabb(octree_t *octree, aabb_t aabb, octree_handle_t *results, size_t capacity);
+
+extern size_t
+octree_query_sphere(octree_t *octree, vec3_t centre, float radius,
+		    octree_handle_t *results, size_t capacity);
+
+extern size_t
+octree_query_frustum(octree_t *octree, const frustum_t *frustum,
+		     octree_handle_t *results, size_t capacity);
+
+/*
+ * @description As the region queries above, walking on @scratch's
+ * stack and writing the matches to @scratch->results, which is grown
+ * as they are found, so a single walk always collects all
+ * @scratch->count of them. A zeroed scratch starts out empty.
+ * @return 0 on success, -1 when out of memory, with no matches kept.
+ */
+extern int
+octree_query_aabb_into(octree_t *octree, aabb_t aabb, octree_scratch_t *scratch);
+
+extern int
+octree_query_sphere_into(octree_t *octree, vec3_t centre, float radius, octree_scratch_t *scratch);
+
+extern int
+octree_query_frustum_into(octree_t *octree, const frustum_t *frustum, octree_scratch_t *scratch);
+
+/*
+ * @description Count the matches of the queries above without writing
+ * any handles; subtrees that lie entirely inside the region are counted
+ * without testing their objects.
+ */
+extern size_t
+octree_count_aabb(octree_t *octree, aabb_t aabb);
+
+extern size_t
+octree_count_sphere(octree_t *octree, vec3_t centre, float radius);
+
+extern size_t
+octree_count_frustum(octree_t *octree, const frustum_t *frustum);
+
+/*
+ * @description Finds the @k objects closest to @point, measured to the
+ * nearest point of each box, and stores them in @hits nearest first
+ * with their distance in t. Nodes are visited best first, so only the
+ * part of the tree closer than the k-th candidate is searched.
+ * @return The number of hits stored, fewer than @k when the tree holds
+ * fewer objects, or -1 when out of memory.
+ */
+extern int
+octree_knn(octree_t *octree, vec3_t point, int k, octree_hit_t *hits);
+
+extern int
+octree_nearest(octree_t *octree, vec3_t point, octree_hit_t *hit);
+
+/*
+ * @description Finds every pair of overlapping objects, each exactly
+ * once, spreading subtrees over @threads threads (0 for every core)
+ * that collect into their own buffers. On success *@result holds
+ * *@count pairs in no particular order and must be released with
+ * free().
+ * @return 0 on success, -1 when out of memory.
+ */
+extern int
+octree_collect_pairs(octree_t *octree, int threads, octree_pair_t **result, size_t *count);
+
+extern aabb_t
+octree_get(octree_t *octree, octree_handle_t handle);
 
+extern void *
+octree_data(octree_t *octree, octree_handle_t handle);
+
+extern void
+octree_set_data(octree_t *octree, octree_handle_t handle, void *data);
+
+/*
+ * @description Removes the object named by @handle. Children left
+ * empty are freed, and leaves holding at most
+ * OCTREE_COLLAPSE_THRESHOLD() of the tree's split objects between them
+ * are folded back into their parent, well short of splitting again.
+ * @return 0 on success, -1 for a stale handle.
+ */
 extern int
-octree_insert(octree_t *octree, aabb_t aabb);
+octree_remove(octree_t *octree, octree_handle_t handle);
 
-extern aabb_t 
-octree_find(octree_t *octree, ray_t ray);
+/*
+ * @description Removes one object equal to @aabb, as octree_remove().
+ * @return 0 on success, -1 when no such object is stored.
+ */
+extern int
+octree_remove_aabb(octree_t *octree, aabb_t aabb);
+
+/*
+ * @description Moves the object named by @handle so that it covers
+ * @aabb. The object is rewritten in place while @aabb stays inside its
+ * node's loose bounds and only otherwise removed and inserted again,
+ * keeping its handle. @return 0 on success, -1 for a stale handle.
+ */
+extern int
+octree_update(octree_t *octree, octree_handle_t handle, aabb_t aabb);
 
 extern void
 octree_free(octree_t *octree);
@@ -30,4 +391,99 @@ octree_free(octree_t *octree);
 extern void
 octree_render(octree_t *octree);
 
+/*
+ * @description Starts drawing @octree with the current projection and
+ * view matrices, to be carried on by octree_render_step() so that a
+ * large tree can be drawn in slices. The tree must not change until
+ * the render is done.
+ */
+extern void
+octree_render_begin(octree_t *octree, octree_render_t *render);
+
+/*
+ * @description Draws at most @budget more nodes of @render along with
+ * their objects.
+ * @return 1 while nodes are left to draw, 0 once the render is done.
+ */
+extern int
+octree_render_step(octree_render_t *render, size_t budget);
+
+/*
+ * @description The bounds @octree accepts objects within, its cell
+ * scaled by the tree's looseness.
+ */
+extern aabb_t
+octree_loose_bounds(const octree_t *octree);
+
+/*
+ * @description The cell of child @i of a node with cell @aabb, and
+ * @aabb grown by @looseness around its centre. Every node's cell is
+ * derived from the root with these, so they can be recomputed exactly
+ * from the root bounds and the path of octants.
+ */
+extern aabb_t
+octree_quadrant(aabb_t aabb, int i);
+
+extern aabb_t
+octree_loosen(aabb_t aabb, float looseness);
+
+extern void
+octree_memory(octree_t *octree, octree_memory_t *memory);
+
+/*
+ * @description Writes the memory report of @octree to @stream, along
+ * with the cost of the same tree using fixed 100 object nodes.
+ */
+extern void
+octree_memory_print(octree_t *octree, FILE *stream);
+
+extern octree_snapshot_t *
+octree_snapshot_create(aabb_t aabb, float looseness);
+
+/*
+ * @description Writer side, calls must not overlap. Each call
+ * publishes a new version. Handles count up from 0 and are not reused.
+ * @return The new handle or OCTREE_HANDLE_NONE, and 0 or -1 for
+ * removal.
+ */
+extern octree_handle_t
+octree_snapshot_insert(octree_snapshot_t *snapshot, aabb_t aabb);
+
+extern int
+octree_snapshot_remove(octree_snapshot_t *snapshot, octree_handle_t handle);
+
+/*
+ * @description Claims one of OCTREE_SNAPSHOT_READERS reader slots for
+ * the calling thread.
+ * @return The slot, or -1 when all are taken.
+ */
+extern int
+octree_snapshot_reader(octree_snapshot_t *snapshot);
+
+extern void
+octree_snapshot_reader_release(octree_snapshot_t *snapshot, int reader);
+
+/*
+ * @description Pins the current version for @reader and returns its
+ * root, which stays valid and unchanged until octree_snapshot_leave().
+ * Only read-only calls may be made on it.
+ */
+extern octree_t *
+octree_snapshot_enter(octree_snapshot_t *snapshot, int reader);
+
+extern void
+octree_snapshot_leave(octree_snapshot_t *snapshot, int reader);
+
+/*
+ * @description Reader side, between octree_snapshot_enter() and
+ * octree_snapshot_leave(): the box of @handle, which must be held by
+ * the pinned version, such as a handle octree_find() returned on it.
+ * @return The box, or aabb_empty() for a handle never inserted.
+ */
+extern aabb_t
+octree_snapshot_get(octree_snapshot_t *snapshot, octree_handle_t handle);
+
+extern void
+octree_snapshot_free(octree_snapshot_t *snapshot);
+
 #endif /* OCTREE_H_ */
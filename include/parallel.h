@@ -0,0 +1,37 @@
+#ifndef PARALLEL_H_
+#define PARALLEL_H_
+
+#include <stddef.h>
+
+#define PARALLEL_MAXIMUM_THREADS (64)
+
+/*
+ * @description Work item callback, @thread is the index of the
+ * worker running it, in [0, threads), for indexing per-thread state.
+ */
+typedef void (*parallel_fn_t)(void *arg, size_t index, int thread);
+
+extern int
+parallel_threads(void);
+
+/*
+ * @description Calls @fn for every index in [0, @n) on up to
+ * @threads threads, 0 meaning one per online core. Indices are handed
+ * out one at a time so uneven items balance themselves. The calling
+ * thread takes part as worker 0 and the call returns once every item
+ * has finished.
+ */
+extern void
+parallel_for(size_t n, int threads, parallel_fn_t fn, void *arg);
+
+/*
+ * @description Like parallel_for(), but [0, @n) is cut into chunks of
+ * @grain indices dealt out in contiguous runs to per-worker deques.
+ * Each worker drains its own deque from the bottom and, once empty,
+ * steals chunks from the top of the others', so neighbouring indices
+ * tend to stay on one thread without losing balance.
+ */
+extern void
+parallel_steal(size_t n, size_t grain, int threads, parallel_fn_t fn, void *arg);
+
+#endif /* PARALLEL_H_ */
@@ -0,0 +1,105 @@
+#ifndef QUERY_H_
+#define QUERY_H_
+
+#include <stddef.h>
+#include "arena.h"
+#include "frustum.h"
+#include "octree.h"
+#include "parallel.h"
+
+/*
+ * Runs large batches of read-only queries against one octree over a
+ * set of workers. Queries are spread with parallel_steal(); every
+ * worker keeps a traversal stack and a growing handle list in its
+ * octree_scratch_t, and an arena the handle lists of its results are
+ * copied into, so a run allocates nothing once the scratch lists and
+ * arenas have grown.
+ */
+#define QUERY_GRAIN (64)
+#define QUERY_TUNE_RUNS (3)
+
+typedef enum query_type_t {
+	QUERY_RAY,
+	QUERY_AABB,
+	QUERY_SPHERE,
+	QUERY_FRUSTUM
+} query_type_t;
+
+typedef struct query_t {
+	query_type_t type;
+	union {
+		ray_t ray;
+		aabb_t aabb;
+		struct {
+			vec3_t centre;
+			float radius;
+		} sphere;
+		const frustum_t *frustum;
+	};
+} query_t;
+
+/*
+ * A ray query fills in @hit and reports 0 or 1 in @count, a region
+ * query lists its @count matches in @handles.
+ */
+typedef struct query_result_t {
+	octree_hit_t hit;
+	octree_handle_t *handles;
+	size_t count;
+} query_result_t;
+
+typedef struct query_worker_t {
+	octree_scratch_t scratch;
+	arena_t *arena;
+	int failed;
+} __attribute__((aligned(64))) query_worker_t;
+
+typedef struct query_executor_t {
+	int threads;
+	query_worker_t workers[PARALLEL_MAXIMUM_THREADS];
+} query_executor_t;
+
+/*
+ * @description Creates an executor with @threads workers, 0 meaning
+ * one per online core.
+ */
+extern query_executor_t *
+query_executor_create(int threads);
+
+/*
+ * @description Answers @queries[i] into @results[i] for every i below
+ * @n. Handle lists stay valid until the next run or reset.
+ * @return 0 on success, -1 if a worker ran out of memory, in which
+ * case the results of some region queries are incomplete.
+ */
+extern int
+query_executor_run(query_executor_t *executor, octree_t *octree,
+		   const query_t *queries, size_t n, query_result_t *results);
+
+/*
+ * @description Releases the handle lists of earlier runs while keeping
+ * the memory for the next one.
+ */
+extern void
+query_executor_reset(query_executor_t *executor);
+
+extern void
+query_executor_free(query_executor_t *executor);
+
+/*
+ * @description Picks the depth and split threshold that answer
+ * @queries fastest over @boxes, a sample of the data the tree will
+ * hold. Every candidate is built with octree_build_config() and timed
+ * on one worker, best of QUERY_TUNE_RUNS runs; candidates whose tree
+ * takes more than @budget bytes per object, 0 meaning no limit, are
+ * skipped. Per object, the sample's cost carries over to the full
+ * tree, where its total would not. The bounds and looseness are taken
+ * from @config, which receives the winner.
+ * @return 0 on success, -1 when no candidate fits in @budget or memory
+ * runs out.
+ */
+extern int
+query_tune(const aabb_t *boxes, size_t n, const query_t *queries, size_t nqueries,
+	   size_t budget, octree_config_t *config);
+
+#endif /* QUERY_H_ */
@@ -3,12 +3,45 @@
 
 #include "linear.h"
 
+/*
+ * Direction components smaller than this are treated as this value
+ * with their sign. A component that is exactly zero gets an inverse of
+ * +inf instead, so a slab plane the origin lies on gives 0 * inf, a
+ * NaN, and every slab test keeps its running bound when a plane's
+ * distance is NaN. The slab of such an axis is then either empty or
+ * unbounded, even when it has no width.
+ */
+#define RAY_EPSILON (1e-20)
+
 typedef struct ray_t {
 	vec3_t origin;
 	vec3_t direction;
+	vec3_t inverse;  /* 1 / direction */
+	int sign[3];     /* 1 where the direction is negative */
 } ray_t;
 
+/*
+ * A group of rays laid out lane by lane so one slab test covers the
+ * whole packet. @t holds each lane's closest hit so far.
+ */
+#define RAY_PACKET_SIZE (8)
+
+typedef struct ray_packet_t {
+	float origin[3][RAY_PACKET_SIZE];
+	float inverse[3][RAY_PACKET_SIZE];
+	float t[RAY_PACKET_SIZE];
+} __attribute__((aligned(32))) ray_packet_t;
+
 extern ray_t
 ray_create(vec3_t origin, vec3_t direction);
 
+/*
+ * @description Loads up to RAY_PACKET_SIZE rays into @packet, with
+ * every lane's distance set to infinity. Unused lanes repeat the first
+ * ray.
+ * @return The mask of lanes in use.
+ */
+extern int
+ray_packet_create(ray_packet_t *packet, const ray_t *rays, int n);
+
 #endif /* RAY_H_ */
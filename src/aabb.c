@@ -1,5 +1,11 @@
 #include "../include/aabb.h"
 
+#if defined(__AVX__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 
 aabb_buffer_t aabb_buffers[AABB_BUFFER_COUNT];
 GLuint aabb_shader;
@@ -105,13 +111,48 @@ aabb_contains(aabb_t a, aabb_t b)
 {
 	for (int i = 0; i < 3; i++) {
 		if (!((b.min.data[i] >= a.min.data[i] ||
-		       fabsf(b.min.data[i] - a.min.data[i]) < 0.001) &&
+		       fabsf(b.min.data[i] - a.min.data[i]) < AABB_CONTAINS_SLACK) &&
 		      (b.max.data[i] <= a.max.data[i] ||
-		       fabsf(b.max.data[i] - a.max.data[i]) < 0.001))) return 0;
+		       fabsf(b.max.data[i] - a.max.data[i]) < AABB_CONTAINS_SLACK))) return 0;
 	}
 	return 1;
 }
 
+int
+aabb_overlaps(aabb_t a, aabb_t b)
+{
+	int i;
+	for (i = 0; i < 3; i++) {
+		if (a.min.data[i] > b.max.data[i] || b.min.data[i] > a.max.data[i]) return 0;
+	}
+	return 1;
+}
+
+float
+aabb_distance2(aabb_t aabb, vec3_t point)
+{
+	int i;
+	float d, distance = 0.0;
+	for (i = 0; i < 3; i++) {
+		d = fmaxf(aabb.min.data[i] - point.data[i], 0.0);
+		d = fmaxf(point.data[i] - aabb.max.data[i], d);
+		distance += d * d;
+	}
+	return distance;
+}
+
+float
+aabb_farthest2(aabb_t aabb, vec3_t point)
+{
+	int i;
+	float d, distance = 0.0;
+	for (i = 0; i < 3; i++) {
+		d = fmaxf(fabsf(point.data[i] - aabb.min.data[i]), fabsf(aabb.max.data[i] - point.data[i]));
+		distance += d * d;
+	}
+	return distance;
+}
+
 // Slab Method for AABB - Ray Intersection. 
 vec2_t
 aabb_ray_intersect(ray_t ray, aabb_t aabb)
@@ -122,11 +163,12 @@ aabb_ray_intersect(ray_t ray, aabb_t aabb)
 	
 	tmin = 0, tmax = INFINITY;
 	for (i = 0; i < 3; i++) {
-		t0 = (aabb.min.data[i] - ray.origin.data[i]) / ray.direction.data[i];
-		t1 = (aabb.max.data[i] - ray.origin.data[i]) / ray.direction.data[i];
+		// the sign picks which slab plane the ray reaches first, a NaN keeps the bound
+		t0 = ((ray.sign[i] ? aabb.max : aabb.min).data[i] - ray.origin.data[i]) * ray.inverse.data[i];
+		t1 = ((ray.sign[i] ? aabb.min : aabb.max).data[i] - ray.origin.data[i]) * ray.inverse.data[i];
 
-		tmin = fminf(fmaxf(t0, tmin), fmaxf(t1, tmin));
-		tmax = fmaxf(fminf(t0, tmax), fminf(t1, tmax));
+		tmin = t0 > tmin ? t0 : tmin;
+		tmax = t1 < tmax ? t1 : tmax;
 	}
 
 	return ll_vec2_create2f(tmin, tmax);
@@ -138,3 +180,156 @@ aabb_ray_hit(ray_t ray, aabb_t aabb)
 	vec2_t intersect = aabb_ray_intersect(ray, aabb);
 	return intersect.x <= intersect.y;
 }
+
+long
+aabb_ray_nearest(ray_t ray, const float *soa, size_t stride, size_t n, float *t)
+{
+	int i;
+	size_t j = 0;
+	long nearest = -1;
+	float best = *t;
+	const float *near[3], *far[3];
+
+	for (i = 0; i < 3; i++) {
+		near[i] = soa + (ray.sign[i] ? 3 + i : i) * stride;
+		far[i] = soa + (ray.sign[i] ? i : 3 + i) * stride;
+	}
+
+#if defined(__AVX__)
+	{
+		float entry[8];
+		__m256 origin[3], inverse[3];
+		for (i = 0; i < 3; i++) {
+			origin[i] = _mm256_set1_ps(ray.origin.data[i]);
+			inverse[i] = _mm256_set1_ps(ray.inverse.data[i]);
+		}
+
+		for (; j + 8 <= n; j += 8) {
+			int mask;
+			__m256 tmin = _mm256_setzero_ps(), tmax = _mm256_set1_ps(INFINITY);
+			for (i = 0; i < 3; i++) {
+				__m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(near[i] + j), origin[i]), inverse[i]);
+				__m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(far[i] + j), origin[i]), inverse[i]);
+				tmin = _mm256_max_ps(t0, tmin);
+				tmax = _mm256_min_ps(t1, tmax);
+			}
+
+			mask = _mm256_movemask_ps(_mm256_and_ps(_mm256_cmp_ps(tmin, tmax, _CMP_LE_OQ),
+							       _mm256_cmp_ps(tmin, _mm256_set1_ps(best), _CMP_LT_OQ)));
+			if (!mask) continue;
+			_mm256_storeu_ps(entry, tmin);
+			for (i = 0; i < 8; i++) {
+				if ((mask & (1 << i)) && entry[i] < best) {
+					best = entry[i];
+					nearest = j + i;
+				}
+			}
+		}
+	}
+#elif defined(__SSE2__)
+	{
+		float entry[4];
+		__m128 origin[3], inverse[3];
+		for (i = 0; i < 3; i++) {
+			origin[i] = _mm_set1_ps(ray.origin.data[i]);
+			inverse[i] = _mm_set1_ps(ray.inverse.data[i]);
+		}
+
+		for (; j + 4 <= n; j += 4) {
+			int mask;
+			__m128 tmin = _mm_setzero_ps(), tmax = _mm_set1_ps(INFINITY);
+			for (i = 0; i < 3; i++) {
+				__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(near[i] + j), origin[i]), inverse[i]);
+				__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(far[i] + j), origin[i]), inverse[i]);
+				tmin = _mm_max_ps(t0, tmin);
+				tmax = _mm_min_ps(t1, tmax);
+			}
+
+			mask = _mm_movemask_ps(_mm_and_ps(_mm_cmple_ps(tmin, tmax),
+							  _mm_cmplt_ps(tmin, _mm_set1_ps(best))));
+			if (!mask) continue;
+			_mm_storeu_ps(entry, tmin);
+			for (i = 0; i < 4; i++) {
+				if ((mask & (1 << i)) && entry[i] < best) {
+					best = entry[i];
+					nearest = j + i;
+				}
+			}
+		}
+	}
+#endif
+
+	for (; j < n; j++) {
+		float tmin = 0, tmax = INFINITY;
+		for (i = 0; i < 3; i++) {
+			float t0 = (near[i][j] - ray.origin.data[i]) * ray.inverse.data[i];
+			float t1 = (far[i][j] - ray.origin.data[i]) * ray.inverse.data[i];
+			tmin = t0 > tmin ? t0 : tmin;
+			tmax = t1 < tmax ? t1 : tmax;
+		}
+
+		if (tmin <= tmax && tmin < best) {
+			best = tmin;
+			nearest = j;
+		}
+	}
+
+	*t = best;
+	return nearest;
+}
+
+int
+aabb_ray_packet(const ray_packet_t *packet, aabb_t aabb, int mask, float *entry)
+{
+	int i, lane = 0, hits = 0;
+
+	// lanes carry their own signs, so sort each slab pair with min/max;
+	// the operand order makes a NaN distance, see RAY_EPSILON, drop out
+#if defined(__AVX__)
+	{
+		__m256 tmin = _mm256_setzero_ps(), tmax = _mm256_set1_ps(INFINITY);
+		for (i = 0; i < 3; i++) {
+			__m256 origin = _mm256_load_ps(packet->origin[i]);
+			__m256 inverse = _mm256_load_ps(packet->inverse[i]);
+			__m256 t0 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(aabb.min.data[i]), origin), inverse);
+			__m256 t1 = _mm256_mul_ps(_mm256_sub_ps(_mm256_set1_ps(aabb.max.data[i]), origin), inverse);
+			tmin = _mm256_max_ps(_mm256_min_ps(t1, t0), tmin);
+			tmax = _mm256_min_ps(_mm256_max_ps(t0, t1), tmax);
+		}
+		_mm256_storeu_ps(entry, tmin);
+		hits = _mm256_movemask_ps(_mm256_and_ps(_mm256_cmp_ps(tmin, tmax, _CMP_LE_OQ),
+							_mm256_cmp_ps(tmin, _mm256_load_ps(packet->t), _CMP_LT_OQ)));
+		lane = RAY_PACKET_SIZE;
+	}
+#elif defined(__SSE2__)
+	for (; lane < RAY_PACKET_SIZE; lane += 4) {
+		__m128 tmin = _mm_setzero_ps(), tmax = _mm_set1_ps(INFINITY);
+		for (i = 0; i < 3; i++) {
+			__m128 origin = _mm_load_ps(packet->origin[i] + lane);
+			__m128 inverse = _mm_load_ps(packet->inverse[i] + lane);
+			__m128 t0 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(aabb.min.data[i]), origin), inverse);
+			__m128 t1 = _mm_mul_ps(_mm_sub_ps(_mm_set1_ps(aabb.max.data[i]), origin), inverse);
+			tmin = _mm_max_ps(_mm_min_ps(t1, t0), tmin);
+			tmax = _mm_min_ps(_mm_max_ps(t0, t1), tmax);
+		}
+		_mm_storeu_ps(entry + lane, tmin);
+		hits |= _mm_movemask_ps(_mm_and_ps(_mm_cmple_ps(tmin, tmax),
+						   _mm_cmplt_ps(tmin, _mm_load_ps(packet->t + lane)))) << lane;
+	}
+#endif
+
+	for (; lane < RAY_PACKET_SIZE; lane++) {
+		float tmin = 0, tmax = INFINITY;
+		for (i = 0; i < 3; i++) {
+			float t0 = (aabb.min.data[i] - packet->origin[i][lane]) * packet->inverse[i][lane];
+			float t1 = (aabb.max.data[i] - packet->origin[i][lane]) * packet->inverse[i][lane];
+			float near = t1 < t0 ? t1 : t0, far = t0 > t1 ? t0 : t1;
+			tmin = near > tmin ? near : tmin;
+			tmax = far < tmax ? far : tmax;
+		}
+		entry[lane] = tmin;
+		hits |= (tmin <= tmax && tmin < packet->t[lane]) << lane;
+	}
+
+	return hits & mask;
+}
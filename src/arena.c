@@ -0,0 +1,184 @@
+#include "../include/arena.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define ARENA_HEADER(type) \
+	((sizeof(type) + ARENA_MINIMUM_BLOCK - 1) & ~(size_t) (ARENA_MINIMUM_BLOCK - 1))
+
+arena_t *
+arena_create(size_t slab_size)
+{
+	arena_t *arena;
+	arena = malloc(sizeof(*arena));
+	if (!arena) {
+		return NULL;
+	}
+
+	memset(arena, 0, sizeof(*arena));
+	arena->slab_size = slab_size ? slab_size : ARENA_DEFAULT_SLAB;
+	return arena;
+}
+
+static int
+arena_class(size_t size)
+{
+	int class = 0;
+	size_t block = ARENA_MINIMUM_BLOCK;
+	while (block < size) {
+		block <<= 1;
+		class++;
+	}
+	return class;
+}
+
+static void *
+arena_chunk_alloc(arena_t *arena, size_t size)
+{
+	arena_chunk_t *chunk;
+	chunk = malloc(ARENA_HEADER(arena_chunk_t) + size);
+	if (!chunk) {
+		return NULL;
+	}
+
+	chunk->size = size;
+	chunk->prev = NULL;
+	chunk->next = arena->chunks;
+	if (arena->chunks) {
+		arena->chunks->prev = chunk;
+	}
+	arena->chunks = chunk;
+	arena->reserved += size;
+	arena->used += size;
+	return (unsigned char *) chunk + ARENA_HEADER(arena_chunk_t);
+}
+
+static void
+arena_chunk_release(arena_t *arena, void *ptr)
+{
+	arena_chunk_t *chunk;
+	chunk = (arena_chunk_t *) ((unsigned char *) ptr - ARENA_HEADER(arena_chunk_t));
+	if (chunk->prev) {
+		chunk->prev->next = chunk->next;
+	} else {
+		arena->chunks = chunk->next;
+	}
+	if (chunk->next) {
+		chunk->next->prev = chunk->prev;
+	}
+	arena->reserved -= chunk->size;
+	arena->used -= chunk->size;
+	free(chunk);
+}
+
+static arena_slab_t *
+arena_slab_next(arena_t *arena)
+{
+	arena_slab_t *slab;
+	if (arena->current && arena->current->next) {
+		return arena->current->next;
+	}
+
+	slab = malloc(ARENA_HEADER(arena_slab_t) + arena->slab_size);
+	if (!slab) {
+		return NULL;
+	}
+
+	slab->next = NULL;
+	slab->size = arena->slab_size;
+	if (arena->current) {
+		arena->current->next = slab;
+	} else {
+		arena->slabs = slab;
+	}
+	arena->reserved += slab->size;
+	return slab;
+}
+
+void *
+arena_alloc(arena_t *arena, size_t size)
+{
+	int class;
+	size_t block;
+	void *ptr;
+
+	if (size > arena->slab_size / 2) {
+		return arena_chunk_alloc(arena, size);
+	}
+
+	class = arena_class(size);
+	block = (size_t) ARENA_MINIMUM_BLOCK << class;
+	if (arena->free_lists[class]) {
+		ptr = arena->free_lists[class];
+		arena->free_lists[class] = *(void **) ptr;
+		arena->used += block;
+		return ptr;
+	}
+
+	if (!arena->current || arena->offset + block > arena->current->size) {
+		arena_slab_t *slab = arena_slab_next(arena);
+		if (!slab) {
+			return NULL;
+		}
+		arena->current = slab;
+		arena->offset = 0;
+	}
+
+	ptr = (unsigned char *) arena->current + ARENA_HEADER(arena_slab_t) + arena->offset;
+	arena->offset += block;
+	arena->used += block;
+	return ptr;
+}
+
+void
+arena_release(arena_t *arena, void *ptr, size_t size)
+{
+	int class;
+	if (ptr == NULL) return;
+	if (size > arena->slab_size / 2) {
+		arena_chunk_release(arena, ptr);
+		return;
+	}
+
+	class = arena_class(size);
+	*(void **) ptr = arena->free_lists[class];
+	arena->free_lists[class] = ptr;
+	arena->used -= (size_t) ARENA_MINIMUM_BLOCK << class;
+}
+
+void
+arena_reset(arena_t *arena)
+{
+	while (arena->chunks) {
+		arena_chunk_release(arena, (unsigned char *) arena->chunks + ARENA_HEADER(arena_chunk_t));
+	}
+
+	memset(arena->free_lists, 0, sizeof(arena->free_lists));
+	arena->current = arena->slabs;
+	arena->offset = 0;
+	arena->used = 0;
+}
+
+void
+arena_free(arena_t *arena)
+{
+	arena_slab_t *slab, *next;
+	if (arena == NULL) return;
+	arena_reset(arena);
+	for (slab = arena->slabs; slab; slab = next) {
+		next = slab->next;
+		free(slab);
+	}
+	free(arena);
+}
+
+size_t
+arena_reserved(const arena_t *arena)
+{
+	return arena->reserved;
+}
+
+size_t
+arena_used(const arena_t *arena)
+{
+	return arena->used;
+}
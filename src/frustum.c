@@ -0,0 +1,65 @@
+#include "../include/frustum.h"
+
+frustum_t
+frustum_create(mat4_t view, mat4_t projection)
+{
+	int i, j;
+	float length;
+	frustum_t frustum;
+	mat4_t clip = view;
+
+	// clip = p * view * projection, so each clip coordinate is the dot
+	// product of p with a column; the planes are w + x, w - x and so on
+	ll_mat4_multiply(&clip, &projection);
+	for (i = 0; i < FRUSTUM_PLANES; i++) {
+		float sign = i % 2 ? -1.0 : 1.0;
+		for (j = 0; j < 4; j++) {
+			frustum.planes[i].data[j] = clip.data[j * 4 + 3] + sign * clip.data[j * 4 + i / 2];
+		}
+
+		length = sqrtf(frustum.planes[i].x * frustum.planes[i].x
+			       + frustum.planes[i].y * frustum.planes[i].y
+			       + frustum.planes[i].z * frustum.planes[i].z);
+		if (length > 0.0) {
+			for (j = 0; j < 4; j++) {
+				frustum.planes[i].data[j] /= length;
+			}
+		}
+	}
+	return frustum;
+}
+
+frustum_side_t
+frustum_aabb_masked(const frustum_t *frustum, aabb_t aabb, int *mask)
+{
+	int i, j;
+	float near, far;
+
+	for (i = 0; i < FRUSTUM_PLANES; i++) {
+		const vec4_t *plane = frustum->planes + i;
+		if (!(*mask & (1 << i))) continue;
+
+		// the corners furthest along and against the plane normal
+		near = far = plane->w;
+		for (j = 0; j < 3; j++) {
+			if (plane->data[j] >= 0.0) {
+				far += plane->data[j] * aabb.max.data[j];
+				near += plane->data[j] * aabb.min.data[j];
+			} else {
+				far += plane->data[j] * aabb.min.data[j];
+				near += plane->data[j] * aabb.max.data[j];
+			}
+		}
+
+		if (far < 0.0) return FRUSTUM_OUTSIDE;
+		if (near >= 0.0) *mask &= ~(1 << i);
+	}
+	return *mask ? FRUSTUM_INTERSECT : FRUSTUM_INSIDE;
+}
+
+frustum_side_t
+frustum_aabb(const frustum_t *frustum, aabb_t aabb)
+{
+	int mask = FRUSTUM_MASK_ALL;
+	return frustum_aabb_masked(frustum, aabb, &mask);
+}
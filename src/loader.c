@@ -0,0 +1,314 @@
+#include "../include/loader.h"
+#include "../include/parallel.h"
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <time.h>
+
+typedef struct loader_chunk_t {
+	aabb_t boxes[LOADER_CHUNK_BOXES];
+	size_t n;
+} loader_chunk_t;
+
+/*
+ * Chunks cycle between the parser and the inserters: the parser takes
+ * an empty chunk, fills it and queues it, an inserter dequeues it,
+ * inserts its boxes and hands it back empty. The chunk count is fixed
+ * up front, which is what bounds memory; a parser that runs ahead just
+ * waits for a chunk to come back.
+ */
+typedef struct loader_t {
+	octree_t *octree;
+	pthread_mutex_t lock;
+	pthread_cond_t filled;
+	pthread_cond_t drained;
+	loader_chunk_t **empty;
+	loader_chunk_t **full;  /* ring, oldest at head */
+	int nchunks, nempty, nfull, head;
+	int done, failed;
+	size_t rows;
+	loader_chunk_t *chunk;  /* being filled by the parser */
+} loader_t;
+
+static double
+loader_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void *
+loader_worker(void *arg)
+{
+	size_t i;
+	loader_t *loader = arg;
+	loader_chunk_t *chunk;
+
+	for (;;) {
+		pthread_mutex_lock(&loader->lock);
+		while (loader->nfull == 0 && !loader->done) {
+			pthread_cond_wait(&loader->filled, &loader->lock);
+		}
+		if (loader->nfull == 0) {
+			pthread_mutex_unlock(&loader->lock);
+			break;
+		}
+		chunk = loader->full[loader->head];
+		loader->head = (loader->head + 1) % loader->nchunks;
+		loader->nfull--;
+		pthread_mutex_unlock(&loader->lock);
+
+		// after a failure chunks are still drained so the parser never waits forever
+		for (i = 0; i < chunk->n && !__atomic_load_n(&loader->failed, __ATOMIC_RELAXED); i++) {
+			if (octree_insert_concurrent(loader->octree, chunk->boxes[i], NULL)
+			    == OCTREE_HANDLE_NONE) {
+				__atomic_store_n(&loader->failed, 1, __ATOMIC_RELAXED);
+			}
+		}
+		__atomic_fetch_add(&loader->rows, i, __ATOMIC_RELAXED);
+
+		pthread_mutex_lock(&loader->lock);
+		loader->empty[loader->nempty++] = chunk;
+		pthread_cond_signal(&loader->drained);
+		pthread_mutex_unlock(&loader->lock);
+	}
+	return NULL;
+}
+
+static void
+loader_flush(loader_t *loader)
+{
+	loader_chunk_t *chunk = loader->chunk;
+	if (!chunk) return;
+	loader->chunk = NULL;
+	pthread_mutex_lock(&loader->lock);
+	loader->full[(loader->head + loader->nfull) % loader->nchunks] = chunk;
+	loader->nfull++;
+	pthread_cond_signal(&loader->filled);
+	pthread_mutex_unlock(&loader->lock);
+}
+
+static int
+loader_emit(loader_t *loader, const float *values)
+{
+	int i;
+	aabb_t box;
+
+	for (i = 0; i < 3; i++) {
+		if (!isfinite(values[i]) || !isfinite(values[i + 3]) || values[i] > values[i + 3]) {
+			return -1;
+		}
+		box.min.data[i] = values[i];
+		box.max.data[i] = values[i + 3];
+	}
+
+	if (!loader->chunk) {
+		pthread_mutex_lock(&loader->lock);
+		while (loader->nempty == 0) {
+			pthread_cond_wait(&loader->drained, &loader->lock);
+		}
+		loader->chunk = loader->empty[--loader->nempty];
+		pthread_mutex_unlock(&loader->lock);
+		loader->chunk->n = 0;
+	}
+	loader->chunk->boxes[loader->chunk->n++] = box;
+	if (loader->chunk->n == LOADER_CHUNK_BOXES) {
+		loader_flush(loader);
+	}
+	return 0;
+}
+
+/* six floats separated by commas, surrounding blanks allowed */
+static int
+loader_csv_row(const char *line, float *values)
+{
+	int i;
+	char *end;
+
+	for (i = 0; i < 6; i++) {
+		values[i] = strtof(line, &end);
+		if (end == line) return -1;
+		for (line = end; *line == ' ' || *line == '\t'; line++);
+		if (i < 5 && *line++ != ',') return -1;
+	}
+	for (; *line == ' ' || *line == '\t' || *line == '\r'; line++);
+	return *line == '\0' ? 0 : -1;
+}
+
+/*
+ * Parses the whole rows in @buffer, plus a final unterminated one when
+ * @eof is set, and returns how many bytes were used. The buffer has a
+ * spare byte past @size for the terminator.
+ */
+static size_t
+loader_parse(loader_t *loader, loader_format_t format, char *buffer, size_t size,
+	     int eof, loader_stats_t *stats)
+{
+	size_t used = 0;
+	float values[6];
+
+	if (format == LOADER_BINARY) {
+		for (; used + sizeof(values) <= size; used += sizeof(values)) {
+			memcpy(values, buffer + used, sizeof(values));
+			if (loader_emit(loader, values) < 0) stats->rejected++;
+		}
+		if (eof && used < size) {
+			stats->rejected++;
+			used = size;
+		}
+		return used;
+	}
+
+	while (used < size) {
+		char *line = buffer + used, *end = memchr(line, '\n', size - used);
+		if (!end) {
+			if (!eof) break;
+			end = buffer + size;
+		}
+		*end = '\0';
+		used = end - buffer + (end < buffer + size);
+		if (line[strspn(line, " \t\r")] == '\0') continue;
+		if (loader_csv_row(line, values) < 0 || loader_emit(loader, values) < 0) {
+			stats->rejected++;
+		}
+	}
+	return used;
+}
+
+loader_format_t
+loader_format(const char *path)
+{
+	const char *extension = strrchr(path, '.');
+	return extension && strcasecmp(extension, ".csv") == 0 ? LOADER_CSV : LOADER_BINARY;
+}
+
+int
+loader_load(octree_t *octree, const char *path, loader_format_t format, int threads,
+	    loader_progress_t progress, void *arg, loader_stats_t *stats)
+{
+	int i, workers = 0, status = 0;
+	size_t size = 0, used = 0, got;
+	double start;
+	struct stat st;
+	char *buffer;
+	FILE *stream;
+	loader_t loader = { 0 };
+	loader_stats_t local = { 0 };
+	pthread_t handles[PARALLEL_MAXIMUM_THREADS];
+	loader_chunk_t *chunks;
+
+	if (threads <= 0) {
+		threads = parallel_threads() > 1 ? parallel_threads() - 1 : 1;
+	}
+	if (threads > PARALLEL_MAXIMUM_THREADS) {
+		threads = PARALLEL_MAXIMUM_THREADS;
+	}
+
+	stream = fopen(path, "rb");
+	if (!stream) {
+		return -1;
+	}
+	if (fstat(fileno(stream), &st) == 0 && S_ISREG(st.st_mode)) {
+		local.total = st.st_size;
+	}
+
+	// two spare chunks keep the parser busy while every inserter works
+	loader.octree = octree;
+	loader.nchunks = threads + 2;
+	buffer = malloc(LOADER_READ_BYTES + 1);
+	chunks = malloc(loader.nchunks * sizeof(*chunks));
+	loader.empty = malloc(loader.nchunks * sizeof(*loader.empty));
+	loader.full = malloc(loader.nchunks * sizeof(*loader.full));
+	if (!buffer || !chunks || !loader.empty || !loader.full) {
+		status = -1;
+		goto cleanup;
+	}
+	for (i = 0; i < loader.nchunks; i++) {
+		loader.empty[loader.nempty++] = chunks + i;
+	}
+	pthread_mutex_init(&loader.lock, NULL);
+	pthread_cond_init(&loader.filled, NULL);
+	pthread_cond_init(&loader.drained, NULL);
+
+	for (workers = 0; workers < threads; workers++) {
+		if (pthread_create(&handles[workers], NULL, loader_worker, &loader) != 0) break;
+	}
+	if (workers == 0) {
+		status = -1;
+		goto destroy;
+	}
+
+	start = loader_now();
+	do {
+		got = fread(buffer + size, 1, LOADER_READ_BYTES - size, stream);
+		size += got;
+		local.bytes += got;
+		used = loader_parse(&loader, format, buffer, size, got == 0, &local);
+		if (used == 0 && size == LOADER_READ_BYTES) {
+			// a single CSV line longer than the read buffer
+			status = -1;
+			break;
+		}
+		memmove(buffer, buffer + used, size - used);
+		size -= used;
+
+		if (progress) {
+			local.rows = __atomic_load_n(&loader.rows, __ATOMIC_RELAXED);
+			local.seconds = loader_now() - start;
+			progress(&local, arg);
+		}
+	} while (got > 0 && !__atomic_load_n(&loader.failed, __ATOMIC_RELAXED));
+	if (ferror(stream)) {
+		status = -1;
+	}
+
+	loader_flush(&loader);
+	pthread_mutex_lock(&loader.lock);
+	loader.done = 1;
+	pthread_cond_broadcast(&loader.filled);
+	pthread_mutex_unlock(&loader.lock);
+	for (i = 0; i < workers; i++) {
+		pthread_join(handles[i], NULL);
+	}
+	if (loader.failed) {
+		status = -1;
+	}
+
+	local.rows = loader.rows;
+	local.seconds = loader_now() - start;
+	if (progress) {
+		progress(&local, arg);
+	}
+
+destroy:
+	pthread_cond_destroy(&loader.drained);
+	pthread_cond_destroy(&loader.filled);
+	pthread_mutex_destroy(&loader.lock);
+cleanup:
+	free(loader.full);
+	free(loader.empty);
+	free(chunks);
+	free(buffer);
+	fclose(stream);
+	if (stats) {
+		*stats = local;
+	}
+	return status;
+}
+
+void
+loader_progress_print(const loader_stats_t *stats, void *arg)
+{
+	FILE *stream = arg;
+	fprintf(stream, "\r%zu rows", stats->rows);
+	if (stats->total > 0) {
+		fprintf(stream, " (%.1f%%)", 100.0 * stats->bytes / stats->total);
+	}
+	fprintf(stream, ", %.0f rows/s, %zu rejected",
+		stats->seconds > 0.0 ? stats->rows / stats->seconds : 0.0, stats->rejected);
+	fflush(stream);
+}
@@ -0,0 +1,236 @@
+#include "../include/loctree.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define LOCTREE_STACK (7 * MORTON_MAXIMUM_DEPTH + 8)
+
+typedef struct loctree_entry_t {
+	morton_t code;
+	aabb_t aabb;
+	octree_handle_t handle;
+} loctree_entry_t;
+
+typedef struct loctree_range_t {
+	morton_t code;
+	size_t lo;
+	size_t hi;
+} loctree_range_t;
+
+loctree_t *
+loctree_create(aabb_t aabb)
+{
+	loctree_t *loctree;
+	loctree = malloc(sizeof(*loctree));
+	if (!loctree) {
+		return NULL;
+	}
+
+	memset(loctree, 0, sizeof(*loctree));
+	loctree->aabb = aabb;
+	loctree->depth = LOCTREE_DEFAULT_DEPTH;
+	return loctree;
+}
+
+static int
+loctree_grow(loctree_t *loctree)
+{
+	size_t capacity;
+	morton_t *codes;
+	aabb_t *objects;
+	octree_handle_t *handles;
+	void **data;
+
+	capacity = loctree->capacity ? loctree->capacity * 2 : 64;
+	codes = realloc(loctree->codes, capacity * sizeof(*codes));
+	if (!codes) {
+		return -1;
+	}
+	loctree->codes = codes;
+
+	objects = realloc(loctree->objects, capacity * sizeof(*objects));
+	if (!objects) {
+		return -1;
+	}
+	loctree->objects = objects;
+
+	handles = realloc(loctree->handles, capacity * sizeof(*handles));
+	if (!handles) {
+		return -1;
+	}
+	loctree->handles = handles;
+
+	data = realloc(loctree->data, capacity * sizeof(*data));
+	if (!data) {
+		return -1;
+	}
+	loctree->data = data;
+	loctree->capacity = capacity;
+	return 0;
+}
+
+octree_handle_t
+loctree_insert(loctree_t *loctree, aabb_t aabb, void *data)
+{
+	morton_t code;
+	if (loctree->size == OCTREE_HANDLE_NONE) {
+		return OCTREE_HANDLE_NONE;
+	}
+
+	// boxes reaching outside the root stay at the root, as in octree_insert()
+	code = morton_cell(loctree->aabb, aabb, loctree->depth);
+	if (!code) {
+		code = MORTON_ROOT;
+	}
+
+	if (loctree->size == loctree->capacity && loctree_grow(loctree) < 0) {
+		return OCTREE_HANDLE_NONE;
+	}
+
+	loctree->codes[loctree->size] = code;
+	loctree->objects[loctree->size] = aabb;
+	loctree->handles[loctree->size] = loctree->size;
+	loctree->data[loctree->size] = data;
+	return loctree->size++;
+}
+
+void *
+loctree_data(loctree_t *loctree, octree_handle_t handle)
+{
+	return handle < loctree->size ? loctree->data[handle] : NULL;
+}
+
+void
+loctree_set_data(loctree_t *loctree, octree_handle_t handle, void *data)
+{
+	if (handle < loctree->size) {
+		loctree->data[handle] = data;
+	}
+}
+
+static int
+loctree_entry_compare(const void *a, const void *b)
+{
+	return morton_compare(((const loctree_entry_t *) a)->code,
+			      ((const loctree_entry_t *) b)->code);
+}
+
+// sorts the appended tail and merges it into the sorted head, back to front
+static int
+loctree_commit(loctree_t *loctree)
+{
+	size_t i, n, head, out;
+	loctree_entry_t *tail;
+
+	if (loctree->sorted == loctree->size) {
+		return 0;
+	}
+
+	n = loctree->size - loctree->sorted;
+	tail = malloc(n * sizeof(*tail));
+	if (!tail) {
+		return -1;
+	}
+
+	for (i = 0; i < n; i++) {
+		tail[i].code = loctree->codes[loctree->sorted + i];
+		tail[i].aabb = loctree->objects[loctree->sorted + i];
+		tail[i].handle = loctree->handles[loctree->sorted + i];
+	}
+	qsort(tail, n, sizeof(*tail), loctree_entry_compare);
+
+	head = loctree->sorted;
+	out = loctree->size;
+	while (n > 0) {
+		out--;
+		if (head > 0 && morton_compare(loctree->codes[head-1], tail[n-1].code) > 0) {
+			head--;
+			loctree->codes[out] = loctree->codes[head];
+			loctree->objects[out] = loctree->objects[head];
+			loctree->handles[out] = loctree->handles[head];
+		} else {
+			n--;
+			loctree->codes[out] = tail[n].code;
+			loctree->objects[out] = tail[n].aabb;
+			loctree->handles[out] = tail[n].handle;
+		}
+	}
+
+	free(tail);
+	loctree->sorted = loctree->size;
+	return 0;
+}
+
+// first index in [lo, hi) whose key is not below @key
+static size_t
+loctree_lower_bound(const loctree_t *loctree, size_t lo, size_t hi, uint64_t key)
+{
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (morton_key(loctree->codes[mid]) < key) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
+}
+
+int
+loctree_find(loctree_t *loctree, ray_t ray, octree_hit_t *hit)
+{
+	int top = 0;
+	size_t i;
+	vec2_t intersect;
+	loctree_range_t stack[LOCTREE_STACK];
+
+	hit->handle = OCTREE_HANDLE_NONE;
+	hit->t = INFINITY;
+	if (loctree_commit(loctree) < 0 || loctree->size == 0) {
+		return 0;
+	}
+
+	stack[top++] = (loctree_range_t) { MORTON_ROOT, 0, loctree->size };
+	while (top > 0) {
+		int c;
+		loctree_range_t range = stack[--top];
+
+		// the root also holds the boxes that reach outside its cell
+		if (range.code != MORTON_ROOT) {
+			intersect = aabb_ray_intersect(ray, morton_bounds(loctree->aabb, range.code));
+			if (intersect.x > intersect.y || intersect.x >= hit->t) {
+				continue;
+			}
+		}
+
+		for (i = range.lo; i < range.hi && loctree->codes[i] == range.code; i++) {
+			intersect = aabb_ray_intersect(ray, loctree->objects[i]);
+			if (intersect.x <= intersect.y && intersect.x < hit->t) {
+				hit->handle = loctree->handles[i];
+				hit->t = intersect.x;
+			}
+		}
+
+		for (c = 0; c < 8 && i < range.hi; c++) {
+			morton_t child = range.code << 3 | c;
+			size_t end = loctree_lower_bound(loctree, i, range.hi,
+							 morton_key(child) + morton_span(child));
+			if (end > i) {
+				stack[top++] = (loctree_range_t) { child, i, end };
+				i = end;
+			}
+		}
+	}
+
+	return hit->handle != OCTREE_HANDLE_NONE;
+}
+
+void
+loctree_free(loctree_t *loctree)
+{
+	if (loctree == NULL) return;
+	free(loctree->codes);
+	free(loctree->objects);
+	free(loctree->handles);
+	free(loctree->data);
+	free(loctree);
+}
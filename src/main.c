@@ -4,6 +4,7 @@
 #include "../include/aabb.h"
 #include "../include/octree.h"
 #include "../include/camera.h"
+#include "../include/loader.h"
 
 #include <SDL2/SDL.h>
 #include <GL/glew.h>
@@ -15,6 +16,7 @@ static SDL_GLContext *context;
 static SDL_Event event;
 static int running;
 static octree_t *octree;
+static arena_t *arena;
 
 size_t octree_limit;
 
@@ -28,7 +30,7 @@ octree_random_insert(void)
 	d = a + ((random() / (float) RAND_MAX) * 30.0) + 10.0;
 	e = b + ((random() / (float) RAND_MAX) * 30.0) + 10.0;
 	f = c + ((random() / (float) RAND_MAX) * 30.0) + 10.0;
-	octree_insert(octree, (aabb_t) { {{a,b,c}}, {{d,e,f}}});
+	octree_insert(octree, (aabb_t) { {{a,b,c}}, {{d,e,f}}}, NULL);
 }
 
 enum button_pressed_t {
@@ -62,10 +64,22 @@ main(int argc, char **argv)
 	context = SDL_GL_CreateContext(window);
 	glewInit();
 
+	arena = arena_create(0);
 	octree = octree_create((aabb_t) {
 			{{ 0.0, 0.0, 0.0 }},
 			{{ 500.0, 500.0, 500.0 }}
-		});
+		}, arena);
+
+	if (argc > 1) {
+		loader_stats_t stats;
+		if (loader_load(octree, argv[1], loader_format(argv[1]), 0,
+				loader_progress_print, stderr, &stats) < 0) {
+			fprintf(stderr, "\nfailed to load %s\n", argv[1]);
+		} else {
+			fprintf(stderr, "\nloaded %zu boxes from %s in %.2fs\n",
+				stats.rows, argv[1], stats.seconds);
+		}
+	}
 
 	camera_setup(from,to);
 	glEnable(GL_DEPTH_TEST);
@@ -139,6 +153,8 @@ main(int argc, char **argv)
 		octree_render(octree);
 		SDL_GL_SwapWindow(window);
 	}
+	octree_memory_print(octree, stdout);
+	arena_free(arena);
 	SDL_Quit();
 	return 0;
 }
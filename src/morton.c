@@ -0,0 +1,257 @@
+#include "../include/morton.h"
+#include "../include/parallel.h"
+#include <stdlib.h>
+#include <string.h>
+
+static uint64_t
+morton_spread(uint32_t v)
+{
+	uint64_t x = v & 0x1fffff;
+	x = (x | x << 32) & 0x1f00000000ffffULL;
+	x = (x | x << 16) & 0x1f0000ff0000ffULL;
+	x = (x | x << 8) & 0x100f00f00f00f00fULL;
+	x = (x | x << 4) & 0x10c30c30c30c30c3ULL;
+	x = (x | x << 2) & 0x1249249249249249ULL;
+	return x;
+}
+
+static uint32_t
+morton_compact(uint64_t x)
+{
+	x &= 0x1249249249249249ULL;
+	x = (x ^ (x >> 2)) & 0x10c30c30c30c30c3ULL;
+	x = (x ^ (x >> 4)) & 0x100f00f00f00f00fULL;
+	x = (x ^ (x >> 8)) & 0x1f0000ff0000ffULL;
+	x = (x ^ (x >> 16)) & 0x1f00000000ffffULL;
+	x = (x ^ (x >> 32)) & 0x1fffff;
+	return (uint32_t) x;
+}
+
+uint64_t
+morton_encode(uint32_t x, uint32_t y, uint32_t z)
+{
+	return morton_spread(x) | morton_spread(y) << 1 | morton_spread(z) << 2;
+}
+
+void
+morton_decode(uint64_t code, uint32_t *x, uint32_t *y, uint32_t *z)
+{
+	*x = morton_compact(code);
+	*y = morton_compact(code >> 1);
+	*z = morton_compact(code >> 2);
+}
+
+// exact, unlike aabb_contains(), a box sticking out by any amount is not inside
+static int
+morton_contains(aabb_t bounds, aabb_t aabb)
+{
+	int i;
+	for (i = 0; i < 3; i++) {
+		if (!(aabb.min.data[i] >= bounds.min.data[i] && aabb.max.data[i] <= bounds.max.data[i])) {
+			return 0;
+		}
+	}
+	return 1;
+}
+
+// an axis of no extent is a single cell
+static uint32_t
+morton_quantise(float v, float min, float max, uint32_t cells)
+{
+	float t;
+	if (!(max > min)) return 0;
+	t = (v - min) / (max - min) * cells;
+	if (t <= 0.0) return 0;
+	if (t >= cells) return cells - 1;
+	return (uint32_t) t;
+}
+
+morton_t
+morton_cell(aabb_t bounds, aabb_t aabb, int depth)
+{
+	int i, shift = 0;
+	uint32_t lo[3], cells;
+	morton_t code;
+
+	if (!morton_contains(bounds, aabb)) {
+		return 0;
+	}
+
+	if (depth > MORTON_MAXIMUM_DEPTH) {
+		depth = MORTON_MAXIMUM_DEPTH;
+	}
+
+	cells = (uint32_t) 1 << depth;
+	for (i = 0; i < 3; i++) {
+		uint32_t hi, diff;
+		lo[i] = morton_quantise(aabb.min.data[i], bounds.min.data[i], bounds.max.data[i], cells);
+		hi = morton_quantise(aabb.max.data[i], bounds.min.data[i], bounds.max.data[i], cells);
+		diff = lo[i] ^ hi;
+		while (diff >> shift) {
+			shift++;
+		}
+	}
+
+	code = ((morton_t) 1 << 3 * (depth - shift))
+		| morton_encode(lo[0] >> shift, lo[1] >> shift, lo[2] >> shift);
+
+	// quantising rounds, so a box on a face may land in a cell it sticks out of
+	while (code != MORTON_ROOT && !morton_contains(morton_bounds(bounds, code), aabb)) {
+		code >>= 3;
+	}
+	return code;
+}
+
+int
+morton_depth(morton_t code)
+{
+	return (63 - __builtin_clzll(code)) / 3;
+}
+
+uint64_t
+morton_key(morton_t code)
+{
+	int depth = morton_depth(code);
+	return (code ^ ((morton_t) 1 << 3 * depth)) << 3 * (MORTON_MAXIMUM_DEPTH - depth);
+}
+
+uint64_t
+morton_span(morton_t code)
+{
+	return (uint64_t) 1 << 3 * (MORTON_MAXIMUM_DEPTH - morton_depth(code));
+}
+
+int
+morton_compare(morton_t a, morton_t b)
+{
+	uint64_t ka = morton_key(a), kb = morton_key(b);
+	if (ka != kb) return ka < kb ? -1 : 1;
+	return (a > b) - (a < b);
+}
+
+aabb_t
+morton_bounds(aabb_t bounds, morton_t code)
+{
+	int i, depth;
+	uint32_t cell[3];
+	aabb_t aabb;
+
+	depth = morton_depth(code);
+	morton_decode(code ^ ((morton_t) 1 << 3 * depth), cell, cell+1, cell+2);
+	for (i = 0; i < 3; i++) {
+		uint32_t cells = (uint32_t) 1 << depth;
+		float size = (bounds.max.data[i] - bounds.min.data[i]) / (float) cells;
+		// neighbours share their faces and the outer cells end on @bounds
+		aabb.min.data[i] = bounds.min.data[i] + size * cell[i];
+		aabb.max.data[i] = cell[i] + 1 == cells ? bounds.max.data[i]
+			: bounds.min.data[i] + size * (cell[i] + 1);
+	}
+	return aabb;
+}
+
+#define MORTON_RADIX_BITS (8)
+#define MORTON_RADIX (1 << MORTON_RADIX_BITS)
+
+typedef struct morton_radix_t {
+	const uint64_t *values;
+	const uint32_t *index;
+	uint64_t *values_out;
+	uint32_t *index_out;
+	size_t n;
+	size_t chunks;
+	int shift;
+	size_t (*counts)[MORTON_RADIX];
+} morton_radix_t;
+
+static void
+morton_radix_count(void *arg, size_t chunk, int thread)
+{
+	size_t i, lo, hi;
+	morton_radix_t *radix = arg;
+	lo = radix->n * chunk / radix->chunks;
+	hi = radix->n * (chunk + 1) / radix->chunks;
+	memset(radix->counts[chunk], 0, sizeof(radix->counts[chunk]));
+	for (i = lo; i < hi; i++) {
+		radix->counts[chunk][(radix->values[i] >> radix->shift) & (MORTON_RADIX - 1)]++;
+	}
+}
+
+static void
+morton_radix_scatter(void *arg, size_t chunk, int thread)
+{
+	size_t i, lo, hi, *offsets;
+	morton_radix_t *radix = arg;
+	lo = radix->n * chunk / radix->chunks;
+	hi = radix->n * (chunk + 1) / radix->chunks;
+	offsets = radix->counts[chunk];
+	for (i = lo; i < hi; i++) {
+		size_t out = offsets[(radix->values[i] >> radix->shift) & (MORTON_RADIX - 1)]++;
+		radix->values_out[out] = radix->values[i];
+		radix->index_out[out] = radix->index[i];
+	}
+}
+
+int
+morton_sort(uint64_t *values, uint32_t *index, size_t n, int bits, int threads)
+{
+	int shift;
+	size_t chunk, digit, total;
+	uint64_t *values_tmp;
+	uint32_t *index_tmp;
+	morton_radix_t radix;
+
+	if (n == 0) {
+		return 0;
+	}
+
+	if (threads <= 0) {
+		threads = parallel_threads();
+	}
+
+	values_tmp = malloc(n * sizeof(*values_tmp));
+	index_tmp = malloc(n * sizeof(*index_tmp));
+	radix.chunks = n / 4096 + 1 < (size_t) threads ? n / 4096 + 1 : (size_t) threads;
+	radix.counts = malloc(radix.chunks * sizeof(*radix.counts));
+	if (!values_tmp || !index_tmp || !radix.counts) {
+		free(values_tmp);
+		free(index_tmp);
+		free(radix.counts);
+		return -1;
+	}
+
+	radix.n = n;
+	radix.values = values;
+	radix.index = index;
+	radix.values_out = values_tmp;
+	radix.index_out = index_tmp;
+	for (shift = 0; shift < bits; shift += MORTON_RADIX_BITS) {
+		radix.shift = shift;
+		parallel_for(radix.chunks, threads, morton_radix_count, &radix);
+
+		// turn the counts into each chunk's first output slot per digit
+		total = 0;
+		for (digit = 0; digit < MORTON_RADIX; digit++) {
+			for (chunk = 0; chunk < radix.chunks; chunk++) {
+				size_t count = radix.counts[chunk][digit];
+				radix.counts[chunk][digit] = total;
+				total += count;
+			}
+		}
+
+		parallel_for(radix.chunks, threads, morton_radix_scatter, &radix);
+		radix.values = radix.values_out;
+		radix.index = radix.index_out;
+		radix.values_out = radix.values_out == values_tmp ? values : values_tmp;
+		radix.index_out = radix.index_out == index_tmp ? index : index_tmp;
+	}
+
+	if (radix.values != values) {
+		memcpy(values, radix.values, n * sizeof(*values));
+		memcpy(index, radix.index, n * sizeof(*index));
+	}
+
+	free(values_tmp);
+	free(index_tmp);
+	free(radix.counts);
+	return 0;
+}
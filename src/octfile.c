@@ -0,0 +1,360 @@
+#include "../include/octfile.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define OCTFILE_ALIGNED(n) (((n) + OCTFILE_ALIGN - 1) & ~(uint64_t) (OCTFILE_ALIGN - 1))
+
+/* FNV-1a over 64-bit words, @size is a multiple of 8 */
+static uint64_t
+octfile_checksum(const void *data, size_t size)
+{
+	size_t i;
+	uint64_t word, hash = 0xcbf29ce484222325ULL;
+	const unsigned char *bytes = data;
+	for (i = 0; i < size; i += sizeof(word)) {
+		memcpy(&word, bytes + i, sizeof(word));
+		hash = (hash ^ word) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+/* points the section pointers of @file into its buffer */
+static void
+octfile_attach(octfile_t *file)
+{
+	const unsigned char *base = file->base;
+	file->header = file->base;
+	file->nodes = (const octfile_node_t *) (base + file->header->nodes);
+	file->objects = (const float *) (base + file->header->objects);
+}
+
+octfile_t *
+octree_freeze(octree_t *octree)
+{
+	int i, k;
+	uint32_t head, tail, object = 0;
+	uint64_t nodes_offset, objects_offset, size;
+	octree_memory_t memory = { 0 };
+	octfile_header_t *header;
+	octfile_node_t *nodes;
+	octree_t **queue;
+	float *objects;
+	unsigned char *buffer;
+	octfile_t *file;
+
+	octree_memory(octree, &memory);
+	if (memory.nodes > UINT32_MAX || memory.objects > UINT32_MAX) {
+		return NULL;
+	}
+
+	nodes_offset = OCTFILE_ALIGNED(sizeof(*header));
+	objects_offset = OCTFILE_ALIGNED(nodes_offset + memory.nodes * sizeof(*nodes));
+	size = OCTFILE_ALIGNED(objects_offset + 7 * memory.objects * sizeof(float));
+	queue = malloc(memory.nodes * sizeof(*queue));
+	buffer = calloc(1, size);
+	file = malloc(sizeof(*file));
+	if (!queue || !buffer || !file) {
+		free(queue);
+		free(buffer);
+		free(file);
+		return NULL;
+	}
+
+	header = (octfile_header_t *) buffer;
+	header->magic = OCTFILE_MAGIC;
+	header->version = OCTFILE_VERSION;
+	header->size = size;
+	header->nodes = nodes_offset;
+	header->objects = objects_offset;
+	header->nnodes = memory.nodes;
+	header->nobjects = memory.objects;
+	header->aabb = octree->aabb;
+	header->looseness = octree->state->looseness;
+	nodes = (octfile_node_t *) (buffer + nodes_offset);
+	objects = (float *) (buffer + objects_offset);
+
+	// breadth first, so a node's index is its place in the queue and siblings are adjacent
+	queue[0] = octree;
+	for (head = 0, tail = 1; head < tail; head++) {
+		octree_t *node = queue[head];
+		const octree_objects_t *from = &node->objects;
+		octfile_node_t *to = nodes + head;
+
+		to->first = object;
+		to->count = from->size;
+		for (k = 0; from->size > 0 && k < 6; k++) {
+			memcpy(objects + k * header->nobjects + object, from->data + k * from->capacity,
+			       from->size * sizeof(float));
+		}
+		if (from->size > 0) {
+			memcpy((uint32_t *) (objects + 6 * header->nobjects) + object,
+			       OCTREE_OBJECTS_HANDLES(from), from->size * sizeof(uint32_t));
+		}
+		object += from->size;
+
+		to->child = tail;
+		for (i = 0; i < OCTREE_CHILDREN; i++) {
+			if (node->children[i]) {
+				to->mask |= 1 << i;
+				queue[tail++] = node->children[i];
+			}
+		}
+		if (!to->mask) {
+			to->child = 0;
+		}
+	}
+	free(queue);
+
+	header->checksum = octfile_checksum(buffer + nodes_offset, size - nodes_offset);
+
+	file->base = buffer;
+	file->size = size;
+	file->mapped = 0;
+	octfile_attach(file);
+	return file;
+}
+
+int
+octree_save(octree_t *octree, const char *path)
+{
+	FILE *stream;
+	size_t written;
+	octfile_t *file;
+
+	file = octree_freeze(octree);
+	if (!file) {
+		return -1;
+	}
+
+	stream = fopen(path, "wb");
+	if (!stream) {
+		octfile_close(file);
+		return -1;
+	}
+	written = fwrite(file->base, 1, file->size, stream);
+	if (fclose(stream) != 0 || written != file->size) {
+		octfile_close(file);
+		return -1;
+	}
+	octfile_close(file);
+	return 0;
+}
+
+int
+octfile_header_check(const octfile_header_t *header, uint64_t size)
+{
+	uint64_t body = OCTFILE_ALIGNED(sizeof(*header));
+	if (size < body
+	    || header->magic != OCTFILE_MAGIC
+	    || header->version != OCTFILE_VERSION
+	    || header->size != size
+	    || header->size % sizeof(uint64_t) != 0
+	    || header->nnodes == 0
+	    || header->nodes < body
+	    || header->nodes % OCTFILE_ALIGN != 0
+	    || header->objects % OCTFILE_ALIGN != 0
+	    || header->nodes + (uint64_t) header->nnodes * sizeof(octfile_node_t) > header->objects
+	    || header->objects + 7 * (uint64_t) header->nobjects * sizeof(float) > header->size) {
+		return -1;
+	}
+	return 0;
+}
+
+int
+octfile_node_check(const octfile_header_t *header, const octfile_node_t *node, uint32_t index,
+		   uint32_t child)
+{
+	if ((uint64_t) node->first + node->count > header->nobjects) return -1;
+	if (node->child != (node->mask ? child : 0)) return -1;
+	if (node->mask
+	    && (node->child <= index
+		|| (uint64_t) node->child + __builtin_popcount(node->mask) > header->nnodes)) return -1;
+	return 0;
+}
+
+static int
+octfile_check(const octfile_t *file)
+{
+	int depth = 0;
+	uint32_t i, child = 1, end = 1;
+	const octfile_header_t *header = file->header;
+	uint64_t body = OCTFILE_ALIGNED(sizeof(*header));
+
+	if (octfile_header_check(header, file->size) < 0) {
+		return -1;
+	}
+
+	if (octfile_checksum((const unsigned char *) file->base + body, file->size - body)
+	    != header->checksum) {
+		return -1;
+	}
+
+	// a valid checksum over a hostile file still needs one parent per node and a bounded depth
+	for (i = 0; i < header->nnodes; i++) {
+		if (i == end) {
+			if (++depth > OCTREE_MAXIMUM_DEPTH) return -1;
+			end = child;
+		}
+		if (octfile_node_check(header, file->nodes + i, i, child) < 0) return -1;
+		child += __builtin_popcount(file->nodes[i].mask);
+	}
+	return child == header->nnodes ? 0 : -1;
+}
+
+octfile_t *
+octree_open_mmap(const char *path)
+{
+	int fd;
+	struct stat st;
+	octfile_t *file;
+
+	fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	if (fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(octfile_header_t)
+	    || !(file = malloc(sizeof(*file)))) {
+		close(fd);
+		return NULL;
+	}
+
+	file->size = st.st_size;
+	file->mapped = 1;
+	file->base = mmap(NULL, file->size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (file->base == MAP_FAILED) {
+		free(file);
+		return NULL;
+	}
+
+	octfile_attach(file);
+	if (file->header->nodes > file->size || file->header->objects > file->size
+	    || octfile_check(file) < 0) {
+		octfile_close(file);
+		return NULL;
+	}
+	return file;
+}
+
+static void
+octfile_find_internal(const octfile_t *file, ray_t ray, octree_hit_t *hit)
+{
+	int j, base, size = 1;
+	vec2_t intersect;
+	uint32_t mask, child, stack[OCTREE_STACK];
+	aabb_t cells[OCTREE_STACK];
+	float entry[OCTREE_STACK];
+	uint32_t nobjects = file->header->nobjects;
+	const uint32_t *handles = (const uint32_t *) (file->objects + 6 * nobjects);
+
+	stack[0] = 0;
+	cells[0] = file->header->aabb;
+	entry[0] = -INFINITY;
+	while (size > 0) {
+		const octfile_node_t *node;
+		aabb_t cell = cells[--size];
+		if (entry[size] >= hit->t) continue;
+
+		node = file->nodes + stack[size];
+		if (node->count > 0) {
+			float t = hit->t;
+			long nearest = aabb_ray_nearest(ray, file->objects + node->first, nobjects,
+							node->count, &t);
+			if (nearest >= 0) {
+				hit->handle = handles[node->first + nearest];
+				hit->t = t;
+			}
+		}
+
+		child = node->child;
+		for (mask = node->mask, base = size; mask; mask &= mask - 1, child++) {
+			aabb_t quadrant = octree_quadrant(cell, __builtin_ctz(mask));
+			intersect = aabb_ray_intersect(ray, octree_loosen(quadrant, file->header->looseness));
+			if (intersect.x > intersect.y || intersect.x >= hit->t) continue;
+
+			for (j = size++; j > base && entry[j-1] < intersect.x; j--) {
+				entry[j] = entry[j-1];
+				stack[j] = stack[j-1];
+				cells[j] = cells[j-1];
+			}
+			entry[j] = intersect.x;
+			stack[j] = child;
+			cells[j] = quadrant;
+		}
+	}
+}
+
+int
+octfile_find(const octfile_t *file, ray_t ray, octree_hit_t *hit)
+{
+	hit->handle = OCTREE_HANDLE_NONE;
+	hit->t = INFINITY;
+	octfile_find_internal(file, ray, hit);
+	return hit->handle != OCTREE_HANDLE_NONE;
+}
+
+static void
+octfile_query_internal(const octfile_t *file, aabb_t aabb, octree_handle_t *results, size_t capacity,
+		       size_t *count)
+{
+	int size = 1;
+	uint32_t k, mask, child, stack[OCTREE_STACK];
+	aabb_t cells[OCTREE_STACK];
+	const octfile_header_t *header = file->header;
+	uint32_t nobjects = header->nobjects;
+
+	stack[0] = 0;
+	cells[0] = header->aabb;
+	while (size > 0) {
+		aabb_t cell = cells[--size];
+		const octfile_node_t *node = file->nodes + stack[size];
+		const float *objects = file->objects + node->first;
+
+		for (k = 0; k < node->count; k++) {
+			aabb_t object = {
+				{{ objects[k], objects[nobjects + k], objects[2 * nobjects + k] }},
+				{{ objects[3 * nobjects + k], objects[4 * nobjects + k], objects[5 * nobjects + k] }}
+			};
+			if (aabb_overlaps(aabb, object)) {
+				if (*count < capacity) {
+					results[*count] = ((const uint32_t *) (objects + 6 * nobjects))[k];
+				}
+				(*count)++;
+			}
+		}
+
+		child = node->child;
+		for (mask = node->mask; mask; mask &= mask - 1, child++) {
+			aabb_t quadrant = octree_quadrant(cell, __builtin_ctz(mask));
+			if (aabb_overlaps(aabb, octree_loosen(quadrant, header->looseness))) {
+				stack[size] = child;
+				cells[size++] = quadrant;
+			}
+		}
+	}
+}
+
+size_t
+octfile_query_aabb(const octfile_t *file, aabb_t aabb, octree_handle_t *results, size_t capacity)
+{
+	size_t count = 0;
+	octfile_query_internal(file, aabb, results, results ? capacity : 0, &count);
+	return count;
+}
+
+void
+octfile_close(octfile_t *file)
+{
+	if (!file) return;
+	if (file->mapped) {
+		munmap(file->base, file->size);
+	} else {
+		free(file->base);
+	}
+	free(file);
+}
@@ -0,0 +1,440 @@
+#include "../include/octpage.h"
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define OCTPAGE_INVALID ((uint64_t) -1)
+
+static int
+octpage_pread(int fd, void *buffer, size_t size, uint64_t offset)
+{
+	ssize_t got;
+	unsigned char *bytes = buffer;
+	while (size > 0) {
+		got = pread(fd, bytes, size, offset);
+		if (got <= 0) return -1;
+		bytes += got;
+		offset += got;
+		size -= got;
+	}
+	return 0;
+}
+
+static void
+octpage_unlink(octpage_t *pager, int slot)
+{
+	octpage_entry_t *entry = pager->entries + slot;
+	if (entry->prev >= 0) pager->entries[entry->prev].next = entry->next;
+	else pager->head = entry->next;
+	if (entry->next >= 0) pager->entries[entry->next].prev = entry->prev;
+	else pager->tail = entry->prev;
+}
+
+static void
+octpage_link(octpage_t *pager, int slot, int front)
+{
+	octpage_entry_t *entry = pager->entries + slot;
+	if (front) {
+		entry->prev = -1;
+		entry->next = pager->head;
+		if (pager->head >= 0) pager->entries[pager->head].prev = slot;
+		else pager->tail = slot;
+		pager->head = slot;
+	} else {
+		entry->next = -1;
+		entry->prev = pager->tail;
+		if (pager->tail >= 0) pager->entries[pager->tail].next = slot;
+		else pager->head = slot;
+		pager->tail = slot;
+	}
+}
+
+static const octpage_entry_t *
+octpage_page(octpage_t *pager, uint64_t page)
+{
+	int slot = pager->slots[page];
+	octpage_entry_t *entry;
+	uint64_t offset = page * OCTPAGE_SIZE;
+
+	if (slot >= 0) {
+		pager->stats.hits++;
+		if (slot != pager->head) {
+			octpage_unlink(pager, slot);
+			octpage_link(pager, slot, 1);
+		}
+		return pager->entries + slot;
+	}
+
+	pager->stats.misses++;
+	if (pager->nentries < pager->entries_capacity) {
+		slot = pager->nentries;
+		entry = pager->entries + slot;
+		if (!(entry->data = malloc(OCTPAGE_SIZE))) return NULL;
+		pager->nentries++;
+	} else {
+		slot = pager->tail;
+		entry = pager->entries + slot;
+		octpage_unlink(pager, slot);
+		if (entry->page != OCTPAGE_INVALID) {
+			pager->slots[entry->page] = -1;
+			pager->stats.evictions++;
+		}
+	}
+
+	entry->page = page;
+	entry->size = pager->header.size - offset < OCTPAGE_SIZE
+		? pager->header.size - offset : OCTPAGE_SIZE;
+	if (octpage_pread(pager->fd, entry->data, entry->size, offset) < 0) {
+		// keep the buffer, first in line for reuse
+		entry->page = OCTPAGE_INVALID;
+		octpage_link(pager, slot, 0);
+		return NULL;
+	}
+	pager->stats.bytes += entry->size;
+	pager->slots[page] = slot;
+	octpage_link(pager, slot, 1);
+	return entry;
+}
+
+static int
+octpage_read(octpage_t *pager, uint64_t offset, size_t size, void *buffer)
+{
+	unsigned char *bytes = buffer;
+	while (size > 0) {
+		const octpage_entry_t *entry = octpage_page(pager, offset / OCTPAGE_SIZE);
+		size_t within = offset % OCTPAGE_SIZE, n;
+		if (!entry || within >= entry->size) return -1;
+		n = entry->size - within < size ? entry->size - within : size;
+		memcpy(bytes, entry->data + within, n);
+		bytes += n;
+		offset += n;
+		size -= n;
+	}
+	return 0;
+}
+
+/* asks the kernel to start reading a range unless it is all cached */
+static void
+octpage_prefetch(octpage_t *pager, uint64_t offset, size_t size)
+{
+	uint64_t page;
+	if (size == 0) return;
+	for (page = offset / OCTPAGE_SIZE; page <= (offset + size - 1) / OCTPAGE_SIZE; page++) {
+		if (pager->slots[page] < 0) {
+			posix_fadvise(pager->fd, offset, size, POSIX_FADV_WILLNEED);
+			pager->stats.prefetches++;
+			return;
+		}
+	}
+}
+
+static void
+octpage_prefetch_objects(octpage_t *pager, const octfile_node_t *nodes, int n)
+{
+	int i, k;
+	uint32_t first = UINT32_MAX, last = 0;
+	uint64_t stride = (uint64_t) pager->header.nobjects * sizeof(float);
+
+	for (i = 0; i < n; i++) {
+		if (nodes[i].count == 0) continue;
+		if (nodes[i].first < first) first = nodes[i].first;
+		if (nodes[i].first + nodes[i].count > last) last = nodes[i].first + nodes[i].count;
+	}
+	for (k = 0; first < last && k < 7; k++) {
+		octpage_prefetch(pager, pager->header.objects + k * stride + first * sizeof(float),
+				 (last - first) * sizeof(float));
+	}
+}
+
+/* the children of @node, stored next to each other, in one read */
+static int
+octpage_children(octpage_t *pager, const octfile_node_t *node, octfile_node_t *children)
+{
+	int i, n = __builtin_popcount(node->mask);
+	uint32_t next;
+	if (n == 0) {
+		return 0;
+	}
+	if ((uint64_t) node->child + n <= pager->nresident) {
+		memcpy(children, pager->resident + node->child, n * sizeof(*children));
+		return n;
+	}
+	if (octpage_read(pager, pager->header.nodes + (uint64_t) node->child * sizeof(*children),
+			 n * sizeof(*children), children) < 0) {
+		return -1;
+	}
+	// siblings are adjacent, so their children follow on from each other
+	for (i = 0, next = 0; i < n; i++) {
+		if (!next && children[i].mask) next = children[i].child;
+		if (octfile_node_check(&pager->header, children + i, node->child + i, next) < 0) return -1;
+		next += __builtin_popcount(children[i].mask);
+	}
+	return n;
+}
+
+/* the boxes of @node in scratch, as seven arrays of node->count entries */
+static const float *
+octpage_boxes(octpage_t *pager, const octfile_node_t *node)
+{
+	int k;
+	size_t bytes = (size_t) node->count * sizeof(float);
+	uint64_t stride = (uint64_t) pager->header.nobjects * sizeof(float);
+
+	if (7 * bytes > pager->scratch_capacity) {
+		unsigned char *scratch = realloc(pager->scratch, 7 * bytes);
+		if (!scratch) return NULL;
+		pager->scratch = scratch;
+		pager->scratch_capacity = 7 * bytes;
+	}
+	for (k = 0; k < 7; k++) {
+		if (octpage_read(pager, pager->header.objects + k * stride
+				 + (uint64_t) node->first * sizeof(float),
+				 bytes, pager->scratch + k * bytes) < 0) {
+			return NULL;
+		}
+	}
+	return (const float *) pager->scratch;
+}
+
+/*
+ * Checks every node in order, as octree_open_mmap() does, reading the
+ * node array in chunks of OCTPAGE_CHECK nodes, then reads the first
+ * OCTPAGE_RESIDENT_LEVELS levels again to keep them resident.
+ */
+static int
+octpage_resident(octpage_t *pager)
+{
+	int depth = 0;
+	uint32_t i, k, n, child = 1, end = 1, resident = 0;
+	const octfile_header_t *header = &pager->header;
+	octfile_node_t *chunk = malloc(OCTPAGE_CHECK * sizeof(*chunk));
+
+	if (!chunk) {
+		return -1;
+	}
+	for (i = 0; i < header->nnodes; i += n) {
+		n = header->nnodes - i < OCTPAGE_CHECK ? header->nnodes - i : OCTPAGE_CHECK;
+		if (octpage_pread(pager->fd, chunk, n * sizeof(*chunk),
+				  header->nodes + (uint64_t) i * sizeof(*chunk)) < 0) {
+			free(chunk);
+			return -1;
+		}
+		pager->stats.bytes += n * sizeof(*chunk);
+		for (k = 0; k < n; k++) {
+			if (i + k == end) {
+				if (++depth > OCTREE_MAXIMUM_DEPTH) break;
+				if (depth == OCTPAGE_RESIDENT_LEVELS) resident = end;
+				end = child;
+			}
+			if (octfile_node_check(header, chunk + k, i + k, child) < 0) break;
+			child += __builtin_popcount(chunk[k].mask);
+		}
+		if (k < n) {
+			free(chunk);
+			return -1;
+		}
+	}
+	free(chunk);
+	if (child != header->nnodes) {
+		return -1;
+	}
+
+	if (depth < OCTPAGE_RESIDENT_LEVELS) {
+		resident = header->nnodes;
+	}
+	if (!(pager->resident = malloc(resident * sizeof(*pager->resident)))
+	    || octpage_pread(pager->fd, pager->resident, resident * sizeof(*pager->resident),
+			     header->nodes) < 0) {
+		return -1;
+	}
+	pager->stats.bytes += resident * sizeof(*pager->resident);
+	pager->nresident = resident;
+	return 0;
+}
+
+octpage_t *
+octree_open_paged(const char *path, size_t budget)
+{
+	uint64_t npages, cached;
+	struct stat st;
+	octpage_t *pager;
+
+	pager = calloc(1, sizeof(*pager));
+	if (!pager) {
+		return NULL;
+	}
+	pager->head = pager->tail = -1;
+	pager->fd = open(path, O_RDONLY);
+	if (pager->fd < 0) {
+		free(pager);
+		return NULL;
+	}
+	if (fstat(pager->fd, &st) < 0
+	    || octpage_pread(pager->fd, &pager->header, sizeof(pager->header), 0) < 0
+	    || octfile_header_check(&pager->header, st.st_size) < 0) {
+		octpage_close(pager);
+		return NULL;
+	}
+
+	npages = (pager->header.size + OCTPAGE_SIZE - 1) / OCTPAGE_SIZE;
+	cached = budget / OCTPAGE_SIZE;
+	if (cached == 0) cached = 1;
+	if (cached > npages) cached = npages;
+	pager->entries_capacity = cached;
+	pager->slots = malloc(npages * sizeof(*pager->slots));
+	pager->entries = calloc(pager->entries_capacity, sizeof(*pager->entries));
+	if (!pager->slots || !pager->entries) {
+		octpage_close(pager);
+		return NULL;
+	}
+	memset(pager->slots, 0xff, npages * sizeof(*pager->slots));
+	if (octpage_resident(pager) < 0) {
+		octpage_close(pager);
+		return NULL;
+	}
+	return pager;
+}
+
+/*
+ * As octfile_find_internal(), with each stacked child carrying its node
+ * as read from the file. The children a node reaches are adjacent on
+ * the stack, so their boxes are prefetched together before the nearest
+ * is searched.
+ */
+static int
+octpage_find_internal(octpage_t *pager, ray_t ray, octree_hit_t *hit)
+{
+	int i, j, base, size = 1;
+	uint32_t octants;
+	vec2_t intersect;
+	octfile_node_t nodes[OCTREE_STACK], siblings[OCTREE_CHILDREN];
+	aabb_t cells[OCTREE_STACK];
+	float entry[OCTREE_STACK];
+
+	nodes[0] = pager->resident[0];
+	cells[0] = pager->header.aabb;
+	entry[0] = -INFINITY;
+	while (size > 0) {
+		octfile_node_t node = nodes[--size];
+		aabb_t cell = cells[size];
+		if (entry[size] >= hit->t) continue;
+
+		if (node.count > 0) {
+			float t = hit->t;
+			long nearest;
+			const float *objects = octpage_boxes(pager, &node);
+			if (!objects) return -1;
+			nearest = aabb_ray_nearest(ray, objects, node.count, node.count, &t);
+			if (nearest >= 0) {
+				memcpy(&hit->handle, objects + 6 * node.count + nearest, sizeof(hit->handle));
+				hit->t = t;
+			}
+		}
+
+		if (octpage_children(pager, &node, siblings) < 0) return -1;
+		for (i = 0, base = size, octants = node.mask; octants; octants &= octants - 1, i++) {
+			aabb_t quadrant = octree_quadrant(cell, __builtin_ctz(octants));
+			intersect = aabb_ray_intersect(ray, octree_loosen(quadrant, pager->header.looseness));
+			if (intersect.x > intersect.y || intersect.x >= hit->t) continue;
+			if (size == OCTREE_STACK) return -1;
+
+			for (j = size++; j > base && entry[j-1] < intersect.x; j--) {
+				entry[j] = entry[j-1];
+				nodes[j] = nodes[j-1];
+				cells[j] = cells[j-1];
+			}
+			entry[j] = intersect.x;
+			nodes[j] = siblings[i];
+			cells[j] = quadrant;
+		}
+
+		if (size - base > 1) {
+			octpage_prefetch_objects(pager, nodes + base, size - base);
+		}
+	}
+	return 0;
+}
+
+int
+octpage_find(octpage_t *pager, ray_t ray, octree_hit_t *hit)
+{
+	hit->handle = OCTREE_HANDLE_NONE;
+	hit->t = INFINITY;
+	if (octpage_find_internal(pager, ray, hit) < 0) {
+		return -1;
+	}
+	return hit->handle != OCTREE_HANDLE_NONE;
+}
+
+static int
+octpage_query_internal(octpage_t *pager, aabb_t aabb, octree_handle_t *results, size_t capacity,
+		       size_t *count)
+{
+	int i, base, size = 1;
+	uint32_t k, octants;
+	octfile_node_t nodes[OCTREE_STACK], siblings[OCTREE_CHILDREN];
+	aabb_t cells[OCTREE_STACK];
+
+	nodes[0] = pager->resident[0];
+	cells[0] = pager->header.aabb;
+	while (size > 0) {
+		octfile_node_t node = nodes[--size];
+		aabb_t cell = cells[size];
+
+		if (node.count > 0) {
+			const float *objects = octpage_boxes(pager, &node);
+			if (!objects) return -1;
+			for (k = 0; k < node.count; k++) {
+				if (!aabb_overlaps(aabb, (aabb_t) {
+						{{ objects[k], objects[node.count + k], objects[2 * node.count + k] }},
+						{{ objects[3 * node.count + k], objects[4 * node.count + k],
+						   objects[5 * node.count + k] }}
+					})) continue;
+				if (*count < capacity) {
+					memcpy(results + *count, objects + 6 * node.count + k, sizeof(*results));
+				}
+				(*count)++;
+			}
+		}
+
+		if (octpage_children(pager, &node, siblings) < 0) return -1;
+		for (i = 0, base = size, octants = node.mask; octants; octants &= octants - 1, i++) {
+			aabb_t quadrant = octree_quadrant(cell, __builtin_ctz(octants));
+			if (!aabb_overlaps(aabb, octree_loosen(quadrant, pager->header.looseness))) continue;
+			if (size == OCTREE_STACK) return -1;
+			nodes[size] = siblings[i];
+			cells[size++] = quadrant;
+		}
+
+		if (size - base > 1) {
+			octpage_prefetch_objects(pager, nodes + base, size - base);
+		}
+	}
+	return 0;
+}
+
+int
+octpage_query_aabb(octpage_t *pager, aabb_t aabb, octree_handle_t *results, size_t capacity,
+		   size_t *count)
+{
+	*count = 0;
+	return octpage_query_internal(pager, aabb, results, results ? capacity : 0, count);
+}
+
+void
+octpage_close(octpage_t *pager)
+{
+	int i;
+	if (!pager) return;
+	for (i = 0; i < pager->nentries; i++) {
+		free(pager->entries[i].data);
+	}
+	free(pager->entries);
+	free(pager->slots);
+	free(pager->resident);
+	free(pager->scratch);
+	close(pager->fd);
+	free(pager);
+}
@@ -1,202 +1,2515 @@
 #include "../include/octree.h"
 #include <stdlib.h>
+#include <string.h>
+#include "../include/morton.h"
+#include "../include/parallel.h"
+#include <sched.h>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
-octree_t *
-octree_create(aabb_t aabb)
+// six float arrays for the bounds and one for the handles
+#define OCTREE_OBJECTS_ARRAYS (7)
+#define OCTREE_OBJECTS_BYTES(capacity) (OCTREE_OBJECTS_ARRAYS * (size_t) (capacity) * sizeof(float))
+
+#define OCTREE_SPINS (64)
+
+static void
+octree_lock(int *lock)
+{
+	int spins = 0;
+	while (__atomic_exchange_n(lock, 1, __ATOMIC_ACQUIRE)) {
+		while (__atomic_load_n(lock, __ATOMIC_RELAXED)) {
+			// give the holder a chance to run when cores are oversubscribed
+			if (++spins % OCTREE_SPINS == 0) {
+				sched_yield();
+			}
+#if defined(__SSE2__)
+			_mm_pause();
+#endif
+		}
+	}
+}
+
+static void
+octree_unlock(int *lock)
+{
+	__atomic_store_n(lock, 0, __ATOMIC_RELEASE);
+}
+
+static octree_t *
+octree_node_create(aabb_t aabb, octree_t *parent, octree_state_t *state)
 {
 	size_t i;
 	octree_t *octree;
-	octree = malloc(sizeof(*octree));
+	octree = state->arena ? arena_alloc(state->arena, sizeof(*octree)) : malloc(sizeof(*octree));
 	if (!octree) {
 		return NULL;
 	}
 
-	octree->size = 0;
-
-	for (i = 0; i < OCTREE_LAYER_CAPACITY; i++) {
-		octree->objects[i] = aabb_empty();
-	}
+	octree->objects.data = NULL;
+	octree->objects.size = 0;
+	octree->objects.capacity = 0;
 
 	for (i = 0; i < OCTREE_CHILDREN; i++) {
 		octree->children[i] = NULL;
 	}
 
 	octree->aabb = aabb;
+	octree->parent = parent;
+	octree->state = state;
+	octree->lock = 0;
 	return octree;
 }
 
-static int
-octree_contains(octree_t *octree, aabb_t aabb)
+octree_config_t
+octree_config_default(aabb_t aabb)
+{
+	return (octree_config_t) {
+		aabb, OCTREE_DEFAULT_DEPTH, OCTREE_DEFAULT_SPLIT, OCTREE_DEFAULT_LOOSENESS
+	};
+}
+
+octree_t *
+octree_create(aabb_t aabb, arena_t *arena)
+{
+	octree_config_t config = octree_config_default(aabb);
+	return octree_create_config(&config, arena);
+}
+
+// the state and handle table come from the arena too, so dropping it frees the whole tree
+static void
+octree_state_free(octree_state_t *state)
+{
+	if (state->arena) {
+		if (state->entries) {
+			arena_release(state->arena, state->entries,
+				      state->entries_capacity * sizeof(*state->entries));
+		}
+		arena_release(state->arena, state, sizeof(*state));
+	} else {
+		free(state->entries);
+		free(state);
+	}
+}
+
+octree_t *
+octree_create_config(const octree_config_t *config, arena_t *arena)
 {
-	return aabb_contains(octree->aabb, aabb);
+	octree_state_t *state;
+	if (config->depth < 0 || config->depth > OCTREE_MAXIMUM_DEPTH
+	    || config->split == 0 || !(config->looseness >= 1.0)) {
+		return NULL;
+	}
+
+	state = arena ? arena_alloc(arena, sizeof(*state)) : malloc(sizeof(*state));
+	if (!state) {
+		return NULL;
+	}
+
+	state->arena = arena;
+	state->looseness = config->looseness;
+	state->depth = config->depth;
+	state->split = config->split;
+	state->entries = NULL;
+	state->nentries = 0;
+	state->entries_capacity = 0;
+	state->free_entry = OCTREE_HANDLE_NONE;
+	state->lock = 0;
+	state->root = octree_node_create(config->aabb, NULL, state);
+	if (!state->root) {
+		octree_state_free(state);
+		return NULL;
+	}
+	return state->root;
 }
 
-// change as you please, but be careful since it can crash the program if too deep
-#define OCTREE_MAXIMUM_DEPTH (10)
+int
+octree_set_looseness(octree_t *octree, float looseness)
+{
+	int i;
+	if (looseness < 1.0 || octree->objects.size > 0) {
+		return -1;
+	}
+
+	for (i = 0; i < OCTREE_CHILDREN; i++) {
+		if (octree->children[i]) return -1;
+	}
+
+	octree->state->looseness = looseness;
+	return 0;
+}
 
 static int
-octree_insert_internal(octree_t *octree, aabb_t aabb, int level)
+octree_entries_reserve(octree_state_t *state, uint32_t capacity)
 {
-	int i, j;
-	vec3_t center;
-	aabb_t quadrant;
-	for (i = 0; i < 3; i++) {
-		center.data[i] = (octree->aabb.min.data[i] + octree->aabb.max.data[i]) / 2.0;
+	octree_entry_t *entries;
+	if (capacity <= state->entries_capacity) {
+		return 0;
 	}
 
-	for (i = 0; i < 8 && level < OCTREE_MAXIMUM_DEPTH; i++) {
-		vec3_t qmin, qmax;
-		for (j = 0; j < 3; j++) {
-			if (i & (1<<j)) {
-				qmin.data[j] = octree->aabb.min.data[j];
-				qmax.data[j] = center.data[j];
-			} else {
-				qmin.data[j] = center.data[j];
-				qmax.data[j] = octree->aabb.max.data[j];
-			}
+	if (!state->arena) {
+		entries = realloc(state->entries, capacity * sizeof(*entries));
+	} else if ((entries = arena_alloc(state->arena, capacity * sizeof(*entries))) && state->entries) {
+		memcpy(entries, state->entries, state->entries_capacity * sizeof(*entries));
+		arena_release(state->arena, state->entries, state->entries_capacity * sizeof(*entries));
+	}
+	if (!entries) {
+		return -1;
+	}
+	state->entries = entries;
+	state->entries_capacity = capacity;
+	return 0;
+}
+
+static octree_handle_t
+octree_entry_alloc(octree_state_t *state, void *data)
+{
+	octree_handle_t handle = state->free_entry;
+	if (handle != OCTREE_HANDLE_NONE) {
+		state->free_entry = state->entries[handle].slot;
+	} else {
+		if (state->nentries == OCTREE_HANDLE_NONE
+		    || (state->nentries == state->entries_capacity
+			&& octree_entries_reserve(state, state->entries_capacity
+						  ? state->entries_capacity * 2 : 64) < 0)) {
+			return OCTREE_HANDLE_NONE;
 		}
+		handle = state->nentries++;
+	}
 
-		quadrant.min = qmin;
-		quadrant.max = qmax;
-		
-		if (aabb_contains(quadrant, aabb)) {
-			if (!octree->children[i]) {
-				octree->children[i] = octree_create(quadrant);
-				if (!octree->children[i]) {
-					return -1;
-				}
-				
-				return octree_insert_internal(octree->children[i], aabb, level+1);
-			}
+	state->entries[handle].node = NULL;
+	state->entries[handle].slot = 0;
+	state->entries[handle].data = data;
+	return handle;
+}
+
+static void
+octree_entry_release(octree_state_t *state, octree_handle_t handle)
+{
+	state->entries[handle].node = NULL;
+	state->entries[handle].slot = state->free_entry;
+	state->entries[handle].data = NULL;
+	state->free_entry = handle;
+}
+
+static octree_entry_t *
+octree_entry(octree_t *octree, octree_handle_t handle)
+{
+	octree_state_t *state = octree->state;
+	if (handle >= state->nentries || !state->entries[handle].node) {
+		return NULL;
+	}
+	return state->entries + handle;
+}
+
+static void *
+octree_object_alloc(octree_t *octree, size_t size)
+{
+	arena_t *arena = octree->state->arena;
+	return arena ? arena_alloc(arena, size) : malloc(size);
+}
+
+static void
+octree_object_release(octree_t *octree, void *ptr, size_t size)
+{
+	if (octree->state->arena) {
+		arena_release(octree->state->arena, ptr, size);
+	} else {
+		free(ptr);
+	}
+}
+
+// moves the objects into a block of @capacity entries, which may not be below the size
+static int
+octree_objects_resize(octree_t *octree, uint32_t capacity)
+{
+	int k;
+	octree_objects_t *objects = &octree->objects;
+	float *data = NULL;
+
+	if (capacity > 0) {
+		data = octree_object_alloc(octree, OCTREE_OBJECTS_BYTES(capacity));
+		if (!data) {
+			return -1;
 		}
 	}
 
-	if (octree->size == OCTREE_LAYER_CAPACITY) {
+	for (k = 0; k < OCTREE_OBJECTS_ARRAYS && data && objects->size; k++) {
+		memcpy(data + k * capacity, objects->data + k * objects->capacity,
+		       objects->size * sizeof(*data));
+	}
+
+	octree_object_release(octree, objects->data, OCTREE_OBJECTS_BYTES(objects->capacity));
+	objects->data = data;
+	objects->capacity = capacity;
+	return 0;
+}
+
+static int
+octree_objects_reserve(octree_t *octree, uint32_t capacity)
+{
+	if (capacity <= octree->objects.capacity) {
+		return 0;
+	}
+	return octree_objects_resize(octree, capacity);
+}
+
+static int
+octree_objects_push(octree_t *octree, aabb_t aabb, octree_handle_t handle)
+{
+	octree_entry_t *entry;
+	int k;
+	octree_objects_t *objects = &octree->objects;
+	if (objects->size == objects->capacity
+	    && octree_objects_reserve(octree, objects->capacity
+				      ? objects->capacity * 2
+				      : OCTREE_OBJECTS_MINIMUM) < 0) {
 		return -1;
 	}
 
-	octree->objects[octree->size++] = aabb;
+	for (k = 0; k < 3; k++) {
+		OCTREE_OBJECTS_MIN(objects, k)[objects->size] = aabb.min.data[k];
+		OCTREE_OBJECTS_MAX(objects, k)[objects->size] = aabb.max.data[k];
+	}
+	OCTREE_OBJECTS_HANDLES(objects)[objects->size] = handle;
+
+	entry = octree->state->entries + handle;
+	entry->node = octree;
+	entry->slot = objects->size++;
 	return 0;
 }
 
-int
-octree_insert(octree_t *octree, aabb_t aabb)
+static aabb_t
+octree_objects_get(const octree_objects_t *objects, size_t i)
 {
-	return octree_insert_internal(octree, aabb, 0);
+	int k;
+	aabb_t aabb;
+	for (k = 0; k < 3; k++) {
+		aabb.min.data[k] = OCTREE_OBJECTS_MIN(objects, k)[i];
+		aabb.max.data[k] = OCTREE_OBJECTS_MAX(objects, k)[i];
+	}
+	return aabb;
 }
 
-aabb_t 
-octree_find(octree_t *octree, ray_t ray)
+static int
+octree_objects_index(const octree_objects_t *objects, aabb_t aabb)
 {
-	int i, j;
-	vec3_t center;
-	vec2_t closest_intersect = ll_vec2_create2f(INFINITY, INFINITY), intersect;
-	aabb_t quadrant, closest = aabb_empty();
-	for (i = 0; i < 3; i++) {
-		center.data[i] = (octree->aabb.min.data[i] + octree->aabb.max.data[i]) / 2.0;
-	}
-	
-	for (i = 0; i < 8; i++) {
-		vec3_t qmin, qmax;
-		if (!octree->children[i]) continue;
-		for (j = 0; j < 3; j++) {
-			if (i & (1<<j)) {
-				qmin.data[j] = octree->aabb.min.data[j];
-				qmax.data[j] = center.data[j];
-			} else {
-				qmin.data[j] = center.data[j];
-				qmax.data[j] = octree->aabb.max.data[j];
-			}
+	uint32_t i;
+	for (i = 0; i < objects->size; i++) {
+		if (OCTREE_OBJECTS_MIN(objects, 0)[i] == aabb.min.x
+		    && OCTREE_OBJECTS_MIN(objects, 1)[i] == aabb.min.y
+		    && OCTREE_OBJECTS_MIN(objects, 2)[i] == aabb.min.z
+		    && OCTREE_OBJECTS_MAX(objects, 0)[i] == aabb.max.x
+		    && OCTREE_OBJECTS_MAX(objects, 1)[i] == aabb.max.y
+		    && OCTREE_OBJECTS_MAX(objects, 2)[i] == aabb.max.z) {
+			return i;
 		}
+	}
+	return -1;
+}
+
+// gives back storage once it is mostly unused
+static void
+octree_objects_shrink(octree_t *octree)
+{
+	octree_objects_t *objects = &octree->objects;
+	uint32_t capacity = objects->capacity;
+	while (objects->size * 4 <= capacity && capacity > OCTREE_OBJECTS_MINIMUM) {
+		capacity /= 2;
+	}
+	if (objects->size == 0) {
+		capacity = 0;
+	}
+	if (capacity != objects->capacity) {
+		octree_objects_resize(octree, capacity);
+	}
+}
+
+// copies object @from over @to, the handle as a handle so its bits never pass through a float
+static void
+octree_objects_move(octree_objects_t *objects, uint32_t to, uint32_t from)
+{
+	int k;
+	for (k = 0; k < 3; k++) {
+		OCTREE_OBJECTS_MIN(objects, k)[to] = OCTREE_OBJECTS_MIN(objects, k)[from];
+		OCTREE_OBJECTS_MAX(objects, k)[to] = OCTREE_OBJECTS_MAX(objects, k)[from];
+	}
+	OCTREE_OBJECTS_HANDLES(objects)[to] = OCTREE_OBJECTS_HANDLES(objects)[from];
+}
 
-		quadrant.min = qmin;
-		quadrant.max = qmax;
+// fills slot @i with the last object
+static void
+octree_objects_remove(octree_t *octree, uint32_t i)
+{
+	octree_objects_t *objects = &octree->objects;
+	uint32_t last = --objects->size;
+	octree_objects_move(objects, i, last);
+	octree->state->entries[OCTREE_OBJECTS_HANDLES(objects)[i]].slot = i;
+	octree_objects_shrink(octree);
+}
 
-		intersect = aabb_ray_intersect(ray, quadrant);
-		if (intersect.x <= intersect.y) {
-			aabb_t this_closest = octree_find(octree->children[i], ray);
-			intersect = aabb_ray_intersect(ray, this_closest);
-			if (intersect.x <= intersect.y && intersect.x < closest_intersect.x) {
-				closest_intersect = intersect;
-				closest = this_closest;
-			}
+// exact, unlike aabb_contains(), so stored objects never stick out of the bounds queries test
+static int
+octree_contains(aabb_t bounds, aabb_t aabb)
+{
+	int j;
+	for (j = 0; j < 3; j++) {
+		if (!(aabb.min.data[j] >= bounds.min.data[j] && aabb.max.data[j] <= bounds.max.data[j])) {
+			return 0;
 		}
 	}
+	return 1;
+}
 
-	for (i = 0; i < octree->size; i++) {
-		aabb_t child = octree->objects[i];
-		intersect = aabb_ray_intersect(ray, child);
-		if (intersect.x <= intersect.y && intersect.x < closest_intersect.x) {
-			closest_intersect = intersect;
-			closest = child;
+aabb_t
+octree_quadrant(aabb_t aabb, int i)
+{
+	int j;
+	aabb_t quadrant;
+	for (j = 0; j < 3; j++) {
+		float center = (aabb.min.data[j] + aabb.max.data[j]) / 2.0;
+		if (i & (1<<j)) {
+			quadrant.min.data[j] = aabb.min.data[j];
+			quadrant.max.data[j] = center;
+		} else {
+			quadrant.min.data[j] = center;
+			quadrant.max.data[j] = aabb.max.data[j];
 		}
 	}
+	return quadrant;
+}
+
+aabb_t
+octree_loosen(aabb_t aabb, float looseness)
+{
+	int j;
+	if (looseness == 1.0) {
+		return aabb;
+	}
 
-	return closest;
+	for (j = 0; j < 3; j++) {
+		float margin = (aabb.max.data[j] - aabb.min.data[j]) * (looseness - 1.0) / 2.0;
+		aabb.min.data[j] -= margin;
+		aabb.max.data[j] += margin;
+	}
+	return aabb;
 }
 
-void
-octree_free(octree_t *octree)
+/*
+ * @return The child of @octree that @aabb moves down into, which may
+ * not exist yet, or -1 when @aabb stays in @octree. Only the octant
+ * holding the centre of @aabb is tried, picked by comparing centres
+ * without branching; any box that fits another child's loose cell also
+ * fits that one's.
+ */
+static int
+octree_insert_octant(const octree_t *octree, aabb_t aabb, int level)
+{
+	int i;
+	if (level >= octree->state->depth) {
+		return -1;
+	}
+
+	// twice the centres, a set bit picking the lower half as in octree_quadrant()
+	i = (aabb.min.x + aabb.max.x < octree->aabb.min.x + octree->aabb.max.x)
+		| (aabb.min.y + aabb.max.y < octree->aabb.min.y + octree->aabb.max.y) << 1
+		| (aabb.min.z + aabb.max.z < octree->aabb.min.z + octree->aabb.max.z) << 2;
+	return octree_contains(octree_loosen(octree_quadrant(octree->aabb, i), octree->state->looseness),
+			       aabb) ? i : -1;
+}
+
+static int
+octree_is_leaf(const octree_t *octree)
 {
 	int i;
-	if (octree == NULL) return;
 	for (i = 0; i < OCTREE_CHILDREN; i++) {
-		octree_free(octree->children[i]);
+		if (__atomic_load_n(octree->children + i, __ATOMIC_ACQUIRE)) return 0;
+	}
+	return 1;
+}
+
+/*
+ * Leaves divide once they hold more than the split threshold. Objects
+ * too large for any child stay behind, so a leaf that could not shed
+ * them only tries again each time its size doubles.
+ */
+static int
+octree_split_due(const octree_t *octree, int level)
+{
+	uint32_t size = octree->objects.size, split = octree->state->split;
+	return level < octree->state->depth && size > split
+		&& (size == split + 1 || (size & (size - 1)) == 0);
+}
+
+/*
+ * Concurrent inserts share the arena and the handle table under the
+ * state lock, held only around allocation and entry updates, while
+ * each node's object block has its own lock, which the caller holds.
+ */
+static int
+octree_objects_push_concurrent(octree_t *octree, aabb_t aabb, octree_handle_t handle)
+{
+	int k;
+	uint32_t slot;
+	octree_state_t *state = octree->state;
+	octree_objects_t *objects = &octree->objects;
+
+	if (objects->size == objects->capacity) {
+		octree_lock(&state->lock);
+		k = octree_objects_reserve(octree, objects->capacity
+					   ? objects->capacity * 2
+					   : OCTREE_OBJECTS_MINIMUM);
+		octree_unlock(&state->lock);
+		if (k < 0) {
+			return -1;
+		}
+	}
+
+	slot = objects->size++;
+	for (k = 0; k < 3; k++) {
+		OCTREE_OBJECTS_MIN(objects, k)[slot] = aabb.min.data[k];
+		OCTREE_OBJECTS_MAX(objects, k)[slot] = aabb.max.data[k];
 	}
-	free(octree);
+	OCTREE_OBJECTS_HANDLES(objects)[slot] = handle;
+
+	octree_lock(&state->lock);
+	state->entries[handle].node = octree;
+	state->entries[handle].slot = slot;
+	octree_unlock(&state->lock);
+	return 0;
+}
+
+/*
+ * Moves every object of the leaf @octree that fits a child down into
+ * it. With @concurrent set the caller holds the leaf's lock, so no
+ * other insert can push into the leaf or give it children meanwhile. A
+ * failed allocation leaves the objects not yet moved where they were.
+ */
+static void
+octree_split_node(octree_t *octree, int level, int concurrent)
+{
+	int i, k, failed = 0;
+	uint32_t j, kept = 0;
+	octree_t *child;
+	octree_state_t *state = octree->state;
+	octree_objects_t *objects = &octree->objects;
+
+	for (j = 0; j < objects->size; j++) {
+		aabb_t aabb = octree_objects_get(objects, j);
+		octree_handle_t handle = OCTREE_OBJECTS_HANDLES(objects)[j];
+
+		i = failed ? -1 : octree_insert_octant(octree, aabb, level);
+		if (i >= 0 && !(child = octree->children[i])) {
+			if (concurrent) octree_lock(&state->lock);
+			child = octree_node_create(octree_quadrant(octree->aabb, i), octree, state);
+			if (concurrent) octree_unlock(&state->lock);
+			if (child) {
+				__atomic_store_n(octree->children + i, child, __ATOMIC_RELEASE);
+			}
+		}
+		if (i >= 0 && child) {
+			if (concurrent) octree_lock(&child->lock);
+			k = concurrent ? octree_objects_push_concurrent(child, aabb, handle)
+				: octree_objects_push(child, aabb, handle);
+			if (concurrent) octree_unlock(&child->lock);
+			if (k == 0) continue;
+		}
+		failed |= i >= 0;
+
+		// objects that stay are packed towards the front
+		if (kept != j) {
+			octree_objects_move(objects, kept, j);
+			if (concurrent) octree_lock(&state->lock);
+			state->entries[handle].slot = kept;
+			if (concurrent) octree_unlock(&state->lock);
+		}
+		kept++;
+	}
+
+	objects->size = kept;
+	if (concurrent) octree_lock(&state->lock);
+	octree_objects_shrink(octree);
+	if (concurrent) octree_unlock(&state->lock);
 }
 
+/*
+ * Splits the leaf @octree, then every new child left over the
+ * threshold in turn. With @concurrent set the caller holds the leaf's
+ * lock and each child is locked while it is split.
+ */
 static void
-octree_render_internal(octree_t *octree)
+octree_split(octree_t *octree, int level, int concurrent)
+{
+	int i, size = 1, levels[OCTREE_STACK];
+	octree_t *leaf = octree, *stack[OCTREE_STACK];
+	octree_state_t *state = octree->state;
+
+	stack[0] = octree;
+	levels[0] = level;
+	while (size > 0) {
+		octree = stack[--size];
+		level = levels[size];
+		if (concurrent && octree != leaf) octree_lock(&octree->lock);
+		if (octree == leaf || (octree_is_leaf(octree) && octree->objects.size > state->split
+				       && level < state->depth)) {
+			octree_split_node(octree, level, concurrent);
+			for (i = 0; i < OCTREE_CHILDREN; i++) {
+				if (!octree->children[i]) continue;
+				stack[size] = octree->children[i];
+				levels[size++] = level + 1;
+			}
+		}
+		if (concurrent && octree != leaf) octree_unlock(&octree->lock);
+	}
+}
+
+static int
+octree_insert_internal(octree_t *octree, aabb_t aabb, octree_handle_t handle, int level)
 {
 	int i;
-	if (octree == NULL) return;
+	while (!octree_is_leaf(octree) && (i = octree_insert_octant(octree, aabb, level)) >= 0) {
+		if (!octree->children[i]) {
+			octree->children[i] = octree_node_create(octree_quadrant(octree->aabb, i),
+								 octree, octree->state);
+			if (!octree->children[i]) {
+				return -1;
+			}
+		}
+		octree = octree->children[i];
+		level++;
+	}
 
-	ll_matrix_mode(LL_MATRIX_MODEL);
-	ll_matrix_identity();
-	ll_matrix_scale3f(octree->aabb.max.x-octree->aabb.min.x,
-			  octree->aabb.max.y-octree->aabb.min.y,
-			  octree->aabb.max.z-octree->aabb.min.z);
-	ll_matrix_translate3fv(octree->aabb.min);
-	glUniformMatrix4fv(glGetUniformLocation(aabb_shader, "model"),
-			   1, GL_FALSE, ll_matrix_get_copy().data);
-	glUniform4f(glGetUniformLocation(aabb_shader, "colour"),
-		    1.0, 1.0, 1.0, 1.0);
-	glDrawElements(GL_LINES, 36, GL_UNSIGNED_INT, NULL);
-		
-	for (i = 0; i < octree->size; i++) {
-		aabb_t aabb = octree->objects[i];
-		ll_matrix_mode(LL_MATRIX_MODEL);
-		ll_matrix_identity();
-		ll_matrix_scale3f(aabb.max.x-aabb.min.x,
-				  aabb.max.y-aabb.min.y,
-				  aabb.max.z-aabb.min.z);
-		ll_matrix_translate3fv(aabb.min);
-		glUniformMatrix4fv(glGetUniformLocation(aabb_shader, "model"),
-			   1, GL_FALSE, ll_matrix_get_copy().data);
-		glUniform4f(glGetUniformLocation(aabb_shader, "colour"),
-		    1.0, 1.0, 1.0, 1.0);
-		glDrawElements(GL_TRIANGLES, 24, GL_UNSIGNED_INT, NULL);
+	if (octree_objects_push(octree, aabb, handle) < 0) {
+		return -1;
 	}
+	if (octree_is_leaf(octree) && octree_split_due(octree, level)) {
+		octree_split(octree, level, 0);
+	}
+	return 0;
+}
 
-	for (i = 0; i < OCTREE_CHILDREN; i++) {
-		octree_render_internal(octree->children[i]);
+octree_handle_t
+octree_insert(octree_t *octree, aabb_t aabb, void *data)
+{
+	octree_handle_t handle;
+	handle = octree_entry_alloc(octree->state, data);
+	if (handle == OCTREE_HANDLE_NONE) {
+		return OCTREE_HANDLE_NONE;
+	}
+
+	if (octree_insert_internal(octree, aabb, handle, 0) < 0) {
+		octree_entry_release(octree->state, handle);
+		return OCTREE_HANDLE_NONE;
 	}
+	return handle;
 }
 
-void
-octree_render(octree_t *octree)
+/*
+ * Children are only ever added under their parent's lock, so a node
+ * seen as a leaf while its lock is held stays one until it is let go.
+ * Existing children are followed without locking, which keeps inserts
+ * into different parts of the tree from waiting on each other.
+ */
+static int
+octree_insert_concurrent_internal(octree_t *octree, aabb_t aabb, octree_handle_t handle, int level)
 {
-	glUseProgram(aabb_shader);
-	glBindVertexArray(aabb_buffers[AABB_BUFFER_VAO]);
-	ll_matrix_mode(LL_MATRIX_PROJECTION);
-	glUniformMatrix4fv(glGetUniformLocation(aabb_shader, "projection"),
-			   1, GL_FALSE, ll_matrix_get_copy().data);
-	ll_matrix_mode(LL_MATRIX_VIEW);
-	glUniformMatrix4fv(glGetUniformLocation(aabb_shader, "view"),
-			   1, GL_FALSE, ll_matrix_get_copy().data);
-	octree_render_internal(octree);
-	glBindVertexArray(0);
-	glUseProgram(0);
+	int i, leaf, status;
+	octree_t *child;
+	octree_state_t *state = octree->state;
+
+	for (;;) {
+		if (!octree_is_leaf(octree) && (i = octree_insert_octant(octree, aabb, level)) >= 0
+		    && (child = __atomic_load_n(octree->children + i, __ATOMIC_ACQUIRE))) {
+			octree = child;
+			level++;
+			continue;
+		}
+
+		octree_lock(&octree->lock);
+		leaf = octree_is_leaf(octree);
+		i = leaf ? -1 : octree_insert_octant(octree, aabb, level);
+		if (i < 0) {
+			break;
+		}
+
+		if (!(child = octree->children[i])) {
+			octree_lock(&state->lock);
+			child = octree_node_create(octree_quadrant(octree->aabb, i), octree, state);
+			octree_unlock(&state->lock);
+			if (!child) {
+				octree_unlock(&octree->lock);
+				return -1;
+			}
+			__atomic_store_n(octree->children + i, child, __ATOMIC_RELEASE);
+		}
+		octree_unlock(&octree->lock);
+		octree = child;
+		level++;
+	}
+
+	status = octree_objects_push_concurrent(octree, aabb, handle);
+	if (status == 0 && leaf && octree_split_due(octree, level)) {
+		octree_split(octree, level, 1);
+	}
+	octree_unlock(&octree->lock);
+	return status;
+}
+
+octree_handle_t
+octree_insert_concurrent(octree_t *octree, aabb_t aabb, void *data)
+{
+	octree_handle_t handle;
+	octree_state_t *state = octree->state;
+
+	octree_lock(&state->lock);
+	handle = octree_entry_alloc(state, data);
+	octree_unlock(&state->lock);
+	if (handle == OCTREE_HANDLE_NONE) {
+		return OCTREE_HANDLE_NONE;
+	}
+
+	if (octree_insert_concurrent_internal(octree, aabb, handle, 0) < 0) {
+		octree_lock(&state->lock);
+		octree_entry_release(state, handle);
+		octree_unlock(&state->lock);
+		return OCTREE_HANDLE_NONE;
+	}
+	return handle;
+}
+
+/*
+ * Sort keys are a cell's path below the root followed by a 1 bit,
+ * aligned to the tree's depth. Everything below a cell shares its path,
+ * with the cell's own objects sorting between those of its lower four
+ * octants and its upper four, and 21 levels fit in 64 bits.
+ */
+#define OCTREE_BUILD_KEY_BITS(depth) (3 * (depth) + 1)
+
+typedef struct octree_build_task_t {
+	octree_t *octree;
+	uint64_t key;
+	int depth;
+	size_t lo;
+	size_t hi;
+} octree_build_task_t;
+
+typedef struct octree_build_t {
+	const aabb_t *boxes;
+	aabb_t aabb;
+	int depth;
+	uint32_t split;
+	float looseness;
+	uint64_t *values;
+	uint32_t *index;
+	size_t n;
+	size_t grain;
+	octree_build_task_t *tasks;
+	size_t ntasks;
+	size_t tasks_capacity;
+	int failed;
+} octree_build_t;
+
+/*
+ * The cell of @aabb cut back to the deepest node whose loose bounds,
+ * halved as octree_quadrant() does, contain it exactly, the same node
+ * octree_insert() would pick. Boxes outside the root stay in it.
+ */
+static morton_t
+octree_build_cell(const octree_build_t *build, aabb_t aabb)
+{
+	int d, depth;
+	aabb_t bounds = build->aabb;
+	morton_t code = morton_cell(build->aabb, aabb, build->depth);
+	if (!code) {
+		return MORTON_ROOT;
+	}
+
+	depth = morton_depth(code);
+	for (d = 1; d <= depth; d++) {
+		bounds = octree_quadrant(bounds, 7 ^ (int) (code >> 3 * (depth - d) & 7));
+		if (!octree_contains(octree_loosen(bounds, build->looseness), aabb)) break;
+	}
+	return code >> 3 * (depth - d + 1);
+}
+
+static void
+octree_build_value(void *arg, size_t chunk, int thread)
+{
+	size_t i, lo, hi;
+	octree_build_t *build = arg;
+	lo = chunk * build->grain;
+	hi = lo + build->grain;
+	for (i = lo; i < hi && i < build->n; i++) {
+		int depth;
+		morton_t code = octree_build_cell(build, build->boxes[i]);
+		depth = morton_depth(code);
+		build->values[i] = ((code ^ ((morton_t) 1 << 3 * depth)) << 1 | 1)
+			<< 3 * (build->depth - depth);
+		build->index[i] = i;
+	}
+}
+
+// first index in [lo, hi) whose key is not below @key
+static size_t
+octree_build_bound(const octree_build_t *build, size_t lo, size_t hi, uint64_t key)
+{
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+		if (build->values[mid] < key) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	return lo;
 }
 
+static int
+octree_build_objects(octree_build_t *build, octree_t *octree, size_t lo, size_t hi)
+{
+	size_t i;
+	if (hi > lo && octree_objects_reserve(octree, hi - lo) < 0) {
+		return -1;
+	}
+
+	for (i = lo; i < hi; i++) {
+		octree_objects_push(octree, build->boxes[build->index[i]], build->index[i]);
+	}
+	return 0;
+}
+
+/*
+ * @key is the lowest key below @octree. Ranges too small to be worth
+ * dividing are stored whole.
+ */
+static int
+octree_build_subtree(octree_build_t *build, octree_t *octree, uint64_t key, int depth,
+		     size_t lo, size_t hi, int split)
+{
+	int i;
+	uint64_t own, span;
+	size_t first, last, end;
+
+	if (hi - lo <= build->split || depth == build->depth) {
+		return octree_build_objects(build, octree, lo, hi);
+	}
+
+	own = key | (uint64_t) 1 << 3 * (build->depth - depth);
+	first = octree_build_bound(build, lo, hi, own);
+	last = octree_build_bound(build, first, hi, own + 1);
+	if (octree_build_objects(build, octree, first, last) < 0) {
+		return -1;
+	}
+
+	// the last octant runs to @hi, its end key may not fit in 64 bits
+	span = (uint64_t) 1 << (3 * (build->depth - depth) - 2);
+	for (i = 0; i < 8 && lo < hi; i++, lo = end) {
+		octree_t *child;
+		uint64_t child_key = key + i * span;
+		if (i == 4) lo = last;
+		end = i == 7 ? hi : octree_build_bound(build, lo, hi, child_key + span);
+		if (end == lo) continue;
+
+		// morton octants set a bit for the upper half, octree_quadrant for the lower
+		child = octree_node_create(octree_quadrant(octree->aabb, 7 ^ i), octree, octree->state);
+		if (!child) {
+			return -1;
+		}
+		octree->children[7 ^ i] = child;
+
+		if (split && end - lo <= build->grain) {
+			if (build->ntasks == build->tasks_capacity) {
+				size_t capacity = build->tasks_capacity ? build->tasks_capacity * 2 : 64;
+				octree_build_task_t *tasks = realloc(build->tasks, capacity * sizeof(*tasks));
+				if (!tasks) {
+					return -1;
+				}
+				build->tasks = tasks;
+				build->tasks_capacity = capacity;
+			}
+			build->tasks[build->ntasks++] = (octree_build_task_t) {
+				child, child_key, depth + 1, lo, end
+			};
+		} else if (octree_build_subtree(build, child, child_key, depth + 1, lo, end, split) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void
+octree_build_run(void *arg, size_t index, int thread)
+{
+	octree_build_t *build = arg;
+	octree_build_task_t *task = build->tasks + index;
+	if (octree_build_subtree(build, task->octree, task->key, task->depth,
+				 task->lo, task->hi, 0) < 0) {
+		__atomic_store_n(&build->failed, 1, __ATOMIC_RELAXED);
+	}
+}
+
+static int
+octree_build_task_compare(const void *a, const void *b)
+{
+	const octree_build_task_t *ta = a, *tb = b;
+	size_t na = ta->hi - ta->lo, nb = tb->hi - tb->lo;
+	return (na < nb) - (na > nb);
+}
+
+octree_t *
+octree_build(const aabb_t *boxes, size_t n, aabb_t aabb, int flags, arena_t *arena)
+{
+	octree_config_t config = octree_config_default(aabb);
+	return octree_build_config(boxes, n, &config, flags, arena);
+}
+
+octree_t *
+octree_build_config(const aabb_t *boxes, size_t n, const octree_config_t *config, int flags,
+		    arena_t *arena)
+{
+	int i, threads;
+	size_t j;
+	aabb_t aabb = config->aabb;
+	octree_config_t fitted = *config;
+	octree_t *octree = NULL;
+	octree_build_t build = {0};
+
+	// arenas are not thread safe, so arena backed trees are built on one thread
+	threads = arena ? 1 : parallel_threads();
+
+	if ((flags & OCTREE_BUILD_FIT) && n > 0) {
+		aabb = boxes[0];
+		for (j = 1; j < n; j++) {
+			for (i = 0; i < 3; i++) {
+				aabb.min.data[i] = fminf(aabb.min.data[i], boxes[j].min.data[i]);
+				aabb.max.data[i] = fmaxf(aabb.max.data[i], boxes[j].max.data[i]);
+			}
+		}
+	}
+
+	fitted.aabb = aabb;
+	build.boxes = boxes;
+	build.aabb = aabb;
+	build.depth = config->depth;
+	build.split = config->split;
+	build.looseness = config->looseness;
+	build.values = malloc(n * sizeof(*build.values));
+	build.index = malloc(n * sizeof(*build.index));
+	octree = octree_create_config(&fitted, arena);
+	if (!octree || (n > 0 && (!build.values || !build.index))
+	    || n >= OCTREE_HANDLE_NONE || octree_entries_reserve(octree->state, n) < 0) {
+		goto fail;
+	}
+
+	// entries are filled in as the objects are stored
+	for (j = 0; j < n; j++) {
+		octree->state->entries[j].data = NULL;
+	}
+	octree->state->nentries = n;
+
+	build.n = n;
+	build.grain = 16384;
+	parallel_for((n + build.grain - 1) / build.grain, threads, octree_build_value, &build);
+
+	if (morton_sort(build.values, build.index, n, OCTREE_BUILD_KEY_BITS(build.depth),
+			threads) < 0) {
+		goto fail;
+	}
+
+	// subtrees small enough to be one task are built in parallel, the rest is split here
+	build.grain = n / (threads * 16) > 1024 ? n / (threads * 16) : 1024;
+	if (octree_build_subtree(&build, octree, 0, 0, 0, n, threads > 1) < 0) {
+		goto fail;
+	}
+
+	if (build.ntasks > 0) {
+		qsort(build.tasks, build.ntasks, sizeof(*build.tasks), octree_build_task_compare);
+	}
+	parallel_for(build.ntasks, threads, octree_build_run, &build);
+	if (build.failed) {
+		goto fail;
+	}
+
+	free(build.values);
+	free(build.index);
+	free(build.tasks);
+	return octree;
+fail:
+	octree_free(octree);
+	free(build.values);
+	free(build.index);
+	free(build.tasks);
+	return NULL;
+}
+
+/*
+ * Searches below @octree, keeping the closest hit in @hit. Children are
+ * stacked farthest first so the nearest is searched next, and those
+ * whose entry lies beyond the best hit by the time they come up are
+ * skipped.
+ */
+static void
+octree_find_internal(octree_t *octree, ray_t ray, octree_hit_t *hit)
+{
+	int i, j, base, size = 1;
+	vec2_t intersect;
+	octree_t *stack[OCTREE_STACK];
+	float entry[OCTREE_STACK];
+
+	stack[0] = octree;
+	entry[0] = -INFINITY;
+	while (size > 0) {
+		octree_objects_t *objects;
+		octree = stack[--size];
+		if (entry[size] >= hit->t) continue;
+
+		objects = &octree->objects;
+		if (objects->size > 0) {
+			float t = hit->t;
+			long nearest = aabb_ray_nearest(ray, objects->data, objects->capacity,
+							objects->size, &t);
+			if (nearest >= 0) {
+				hit->handle = OCTREE_OBJECTS_HANDLES(objects)[nearest];
+				hit->t = t;
+			}
+		}
+
+		for (i = 0, base = size; i < OCTREE_CHILDREN; i++) {
+			octree_t *child = octree->children[i];
+			if (!child) continue;
+			intersect = aabb_ray_intersect(ray, octree_loosen(child->aabb,
+									  octree->state->looseness));
+			if (intersect.x > intersect.y || intersect.x >= hit->t) continue;
+
+			for (j = size++; j > base && entry[j-1] < intersect.x; j--) {
+				entry[j] = entry[j-1];
+				stack[j] = stack[j-1];
+			}
+			entry[j] = intersect.x;
+			stack[j] = child;
+		}
+	}
+}
+
+int
+octree_find(octree_t *octree, ray_t ray, octree_hit_t *hit)
+{
+	hit->handle = OCTREE_HANDLE_NONE;
+	hit->t = INFINITY;
+	octree_find_internal(octree, ray, hit);
+	return hit->handle != OCTREE_HANDLE_NONE;
+}
+
+/*
+ * A packet only pays for itself while several lanes are still active,
+ * below that the remaining rays finish on the single ray path.
+ */
+#define OCTREE_PACKET_MINIMUM (2)
+
+typedef struct octree_packet_t {
+	ray_packet_t rays;
+	const ray_t *scalar;
+	octree_hit_t hits[RAY_PACKET_SIZE];
+} octree_packet_t;
+
+/*
+ * As octree_find_internal() for the lanes in @mask. Each stacked child
+ * keeps the lanes that reach it and their entry distances, ordered by
+ * the closest entry of any lane.
+ */
+static void
+octree_find_packet(octree_t *octree, octree_packet_t *packet, int mask)
+{
+	int i, j, lane, lanes, base, size = 1;
+	uint32_t k;
+	octree_t *stack[OCTREE_STACK];
+	int masks[OCTREE_STACK];
+	float nearest[OCTREE_STACK], row[RAY_PACKET_SIZE], entry[OCTREE_STACK][RAY_PACKET_SIZE];
+
+	stack[0] = octree;
+	masks[0] = mask;
+	for (lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+		entry[0][lane] = -INFINITY;
+	}
+	while (size > 0) {
+		octree_objects_t *objects;
+		octree = stack[--size];
+
+		// drop lanes that found something closer since the child was stacked
+		mask = 0;
+		for (k = masks[size]; k; k &= k - 1) {
+			lane = __builtin_ctz(k);
+			mask |= (entry[size][lane] < packet->rays.t[lane]) << lane;
+		}
+		if (!mask) continue;
+
+		if (__builtin_popcount(mask) < OCTREE_PACKET_MINIMUM) {
+			for (; mask; mask &= mask - 1) {
+				lane = __builtin_ctz(mask);
+				octree_find_internal(octree, packet->scalar[lane], packet->hits + lane);
+				packet->rays.t[lane] = packet->hits[lane].t;
+			}
+			continue;
+		}
+
+		// objects are already SoA, so each lane scans them several at a time
+		objects = &octree->objects;
+		for (lanes = objects->size > 0 ? mask : 0; lanes; lanes &= lanes - 1) {
+			long hit;
+			lane = __builtin_ctz(lanes);
+			hit = aabb_ray_nearest(packet->scalar[lane], objects->data, objects->capacity,
+					       objects->size, packet->rays.t + lane);
+			if (hit >= 0) {
+				packet->hits[lane].handle = OCTREE_OBJECTS_HANDLES(objects)[hit];
+				packet->hits[lane].t = packet->rays.t[lane];
+			}
+		}
+
+		for (i = 0, base = size; i < OCTREE_CHILDREN; i++) {
+			float first = INFINITY;
+			octree_t *child = octree->children[i];
+			if (!child) continue;
+			lanes = aabb_ray_packet(&packet->rays,
+						octree_loosen(child->aabb, octree->state->looseness),
+						mask, row);
+			if (!lanes) continue;
+
+			for (k = lanes; k; k &= k - 1) {
+				first = fminf(first, row[__builtin_ctz(k)]);
+			}
+
+			// farthest first, so the nearest is searched next
+			for (j = size++; j > base && nearest[j-1] < first; j--) {
+				nearest[j] = nearest[j-1];
+				stack[j] = stack[j-1];
+				masks[j] = masks[j-1];
+				memcpy(entry[j], entry[j-1], sizeof(entry[j]));
+			}
+			memcpy(entry[j], row, sizeof(row));
+			nearest[j] = first;
+			stack[j] = child;
+			masks[j] = lanes;
+		}
+	}
+}
+
+size_t
+octree_find_batch(octree_t *octree, const ray_t *rays, size_t n, octree_hit_t *hits)
+{
+	int lane, lanes, mask;
+	size_t i, found = 0;
+	octree_packet_t packet;
+
+	for (i = 0; i < n; i += RAY_PACKET_SIZE) {
+		lanes = n - i < RAY_PACKET_SIZE ? (int) (n - i) : RAY_PACKET_SIZE;
+		mask = ray_packet_create(&packet.rays, rays + i, lanes);
+		packet.scalar = rays + i;
+		for (lane = 0; lane < lanes; lane++) {
+			packet.hits[lane].handle = OCTREE_HANDLE_NONE;
+			packet.hits[lane].t = INFINITY;
+		}
+
+		octree_find_packet(octree, &packet, mask);
+		for (lane = 0; lane < lanes; lane++) {
+			hits[i + lane] = packet.hits[lane];
+			found += packet.hits[lane].handle != OCTREE_HANDLE_NONE;
+		}
+	}
+	return found;
+}
+
+aabb_t
+octree_get(octree_t *octree, octree_handle_t handle)
+{
+	octree_entry_t *entry = octree_entry(octree, handle);
+	if (!entry) {
+		return aabb_empty();
+	}
+	return octree_objects_get(&entry->node->objects, entry->slot);
+}
+
+void *
+octree_data(octree_t *octree, octree_handle_t handle)
+{
+	octree_entry_t *entry = octree_entry(octree, handle);
+	return entry ? entry->data : NULL;
+}
+
+void
+octree_set_data(octree_t *octree, octree_handle_t handle, void *data)
+{
+	octree_entry_t *entry = octree_entry(octree, handle);
+	if (entry) {
+		entry->data = data;
+	}
+}
+
+typedef enum octree_shape_t {
+	OCTREE_SHAPE_AABB,
+	OCTREE_SHAPE_SPHERE,
+	OCTREE_SHAPE_FRUSTUM
+} octree_shape_t;
+
+typedef struct octree_query_t {
+	octree_shape_t shape;
+	aabb_t aabb;
+	vec3_t centre;
+	float radius2;
+	const frustum_t *frustum;
+	octree_handle_t *results;  /* NULL when only counting */
+	size_t capacity;
+	size_t count;
+	octree_scratch_t *scratch; /* grows results when set */
+	int failed;
+} octree_query_t;
+
+static frustum_side_t
+octree_query_classify(const octree_query_t *query, aabb_t aabb)
+{
+	int i;
+	switch (query->shape) {
+	case OCTREE_SHAPE_AABB:
+		if (!aabb_overlaps(query->aabb, aabb)) return FRUSTUM_OUTSIDE;
+		for (i = 0; i < 3; i++) {
+			if (aabb.min.data[i] < query->aabb.min.data[i]
+			    || aabb.max.data[i] > query->aabb.max.data[i]) return FRUSTUM_INTERSECT;
+		}
+		return FRUSTUM_INSIDE;
+	case OCTREE_SHAPE_SPHERE:
+		if (aabb_distance2(aabb, query->centre) > query->radius2) return FRUSTUM_OUTSIDE;
+		if (aabb_farthest2(aabb, query->centre) > query->radius2) return FRUSTUM_INTERSECT;
+		return FRUSTUM_INSIDE;
+	case OCTREE_SHAPE_FRUSTUM:
+		return frustum_aabb(query->frustum, aabb);
+	}
+	return FRUSTUM_OUTSIDE;
+}
+
+static void
+octree_query_emit(octree_query_t *query, octree_handle_t handle)
+{
+	if (query->count == query->capacity && query->scratch && !query->failed) {
+		size_t capacity = query->capacity ? query->capacity * 2 : 256;
+		octree_handle_t *results = realloc(query->results, capacity * sizeof(*results));
+		if (results) {
+			query->results = query->scratch->results = results;
+			query->capacity = query->scratch->capacity = capacity;
+		} else {
+			query->failed = 1;
+		}
+	}
+	if (query->count < query->capacity) {
+		query->results[query->count] = handle;
+	}
+	query->count++;
+}
+
+/*
+ * Children found to lie wholly inside the region are stacked with
+ * their flag set, and everything below them is emitted without per
+ * object tests. @stack and @flags hold OCTREE_STACK entries.
+ */
+static void
+octree_query_internal(octree_t *octree, octree_query_t *query,
+		      octree_t **stack, unsigned char *flags)
+{
+	int i, inside, size = 1;
+	uint32_t k;
+
+	stack[0] = octree;
+	flags[0] = 0;
+	while (size > 0) {
+		octree_objects_t *objects;
+		octree = stack[--size];
+		inside = flags[size];
+		objects = &octree->objects;
+
+		if (!inside) {
+			for (k = 0; k < objects->size; k++) {
+				if (octree_query_classify(query, octree_objects_get(objects, k)) != FRUSTUM_OUTSIDE) {
+					octree_query_emit(query, OCTREE_OBJECTS_HANDLES(objects)[k]);
+				}
+			}
+		} else if (query->capacity > query->count || (query->scratch && !query->failed)) {
+			for (k = 0; k < objects->size; k++) {
+				octree_query_emit(query, OCTREE_OBJECTS_HANDLES(objects)[k]);
+			}
+		} else {
+			query->count += objects->size;
+		}
+
+		for (i = 0; i < OCTREE_CHILDREN; i++) {
+			frustum_side_t side = FRUSTUM_INSIDE;
+			octree_t *child = octree->children[i];
+			if (!child) continue;
+			if (!inside) {
+				side = octree_query_classify(query, octree_loosen(child->aabb,
+										  octree->state->looseness));
+			}
+			if (side == FRUSTUM_OUTSIDE) continue;
+			stack[size] = child;
+			flags[size++] = side == FRUSTUM_INSIDE;
+		}
+	}
+}
+
+static size_t
+octree_query(octree_t *octree, octree_query_t *query, octree_handle_t *results, size_t capacity)
+{
+	octree_t *stack[OCTREE_STACK];
+	unsigned char flags[OCTREE_STACK];
+
+	query->results = results;
+	query->capacity = results ? capacity : 0;
+	query->count = 0;
+	octree_query_internal(octree, query, stack, flags);
+	return query->count;
+}
+
+static int
+octree_query_into(octree_t *octree, octree_query_t *query, octree_scratch_t *scratch)
+{
+	query->results = scratch->results;
+	query->capacity = scratch->capacity;
+	query->count = 0;
+	query->scratch = scratch;
+	octree_query_internal(octree, query, scratch->stack, scratch->inside);
+	scratch->count = query->failed ? 0 : query->count;
+	return query->failed ? -1 : 0;
+}
+
+size_t
+octree_query_aabb(octree_t *octree, aabb_t aabb, octree_handle_t *results, size_t capacity)
+{
+	octree_query_t query = { .shape = OCTREE_SHAPE_AABB, .aabb = aabb };
+	return octree_query(octree, &query, results, capacity);
+}
+
+size_t
+octree_query_sphere(octree_t *octree, vec3_t centre, float radius,
+		    octree_handle_t *results, size_t capacity)
+{
+	octree_query_t query = { .shape = OCTREE_SHAPE_SPHERE, .centre = centre, .radius2 = radius * radius };
+	return octree_query(octree, &query, results, capacity);
+}
+
+size_t
+octree_query_frustum(octree_t *octree, const frustum_t *frustum,
+		     octree_handle_t *results, size_t capacity)
+{
+	octree_query_t query = { .shape = OCTREE_SHAPE_FRUSTUM, .frustum = frustum };
+	return octree_query(octree, &query, results, capacity);
+}
+
+int
+octree_query_aabb_into(octree_t *octree, aabb_t aabb, octree_scratch_t *scratch)
+{
+	octree_query_t query = { .shape = OCTREE_SHAPE_AABB, .aabb = aabb };
+	return octree_query_into(octree, &query, scratch);
+}
+
+int
+octree_query_sphere_into(octree_t *octree, vec3_t centre, float radius, octree_scratch_t *scratch)
+{
+	octree_query_t query = { .shape = OCTREE_SHAPE_SPHERE, .centre = centre, .radius2 = radius * radius };
+	return octree_query_into(octree, &query, scratch);
+}
+
+int
+octree_query_frustum_into(octree_t *octree, const frustum_t *frustum, octree_scratch_t *scratch)
+{
+	octree_query_t query = { .shape = OCTREE_SHAPE_FRUSTUM, .frustum = frustum };
+	return octree_query_into(octree, &query, scratch);
+}
+
+size_t
+octree_count_aabb(octree_t *octree, aabb_t aabb)
+{
+	return octree_query_aabb(octree, aabb, NULL, 0);
+}
+
+size_t
+octree_count_sphere(octree_t *octree, vec3_t centre, float radius)
+{
+	return octree_query_sphere(octree, centre, radius, NULL, 0);
+}
+
+size_t
+octree_count_frustum(octree_t *octree, const frustum_t *frustum)
+{
+	return octree_query_frustum(octree, frustum, NULL, 0);
+}
+
+typedef struct octree_knn_node_t {
+	octree_t *node;
+	float distance;
+} octree_knn_node_t;
+
+/* min-heap of nodes to visit, keyed by squared distance to their bounds */
+static int
+octree_knn_push(octree_knn_node_t **heap, size_t *size, size_t *capacity,
+		octree_t *node, float distance)
+{
+	size_t i, parent;
+	if (*size == *capacity) {
+		size_t grown = *capacity ? *capacity * 2 : 64;
+		octree_knn_node_t *resized = realloc(*heap, grown * sizeof(**heap));
+		if (!resized) return -1;
+		*heap = resized;
+		*capacity = grown;
+	}
+
+	for (i = (*size)++; i > 0 && (*heap)[parent = (i - 1) / 2].distance > distance; i = parent) {
+		(*heap)[i] = (*heap)[parent];
+	}
+	(*heap)[i].node = node;
+	(*heap)[i].distance = distance;
+	return 0;
+}
+
+static octree_knn_node_t
+octree_knn_pop(octree_knn_node_t *heap, size_t *size)
+{
+	size_t i = 0, child;
+	octree_knn_node_t top = heap[0], last = heap[--*size];
+	while ((child = 2 * i + 1) < *size) {
+		if (child + 1 < *size && heap[child + 1].distance < heap[child].distance) child++;
+		if (heap[child].distance >= last.distance) break;
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = last;
+	return top;
+}
+
+/* max-heap of the best @size hits so far, the worst on top */
+static void
+octree_knn_sift(octree_hit_t *hits, size_t size, size_t i)
+{
+	size_t child;
+	octree_hit_t hit = hits[i];
+	while ((child = 2 * i + 1) < size) {
+		if (child + 1 < size && hits[child + 1].t > hits[child].t) child++;
+		if (hits[child].t <= hit.t) break;
+		hits[i] = hits[child];
+		i = child;
+	}
+	hits[i] = hit;
+}
+
+static void
+octree_knn_offer(octree_hit_t *hits, size_t *size, size_t k, octree_handle_t handle, float distance)
+{
+	size_t i, parent;
+	if (*size < k) {
+		for (i = (*size)++; i > 0 && hits[parent = (i - 1) / 2].t < distance; i = parent) {
+			hits[i] = hits[parent];
+		}
+		hits[i].handle = handle;
+		hits[i].t = distance;
+	} else if (distance < hits[0].t) {
+		hits[0].handle = handle;
+		hits[0].t = distance;
+		octree_knn_sift(hits, k, 0);
+	}
+}
+
+int
+octree_knn(octree_t *octree, vec3_t point, int k, octree_hit_t *hits)
+{
+	int i;
+	uint32_t j;
+	size_t found = 0, size = 0, capacity = 0;
+	octree_knn_node_t *heap = NULL, next;
+
+	if (k <= 0) return 0;
+	if (octree_knn_push(&heap, &size, &capacity, octree, 0.0) < 0) return -1;
+
+	while (size > 0) {
+		octree_objects_t *objects;
+		next = octree_knn_pop(heap, &size);
+		// nodes come out nearest first, so nothing closer remains
+		if (found == (size_t) k && next.distance >= hits[0].t) break;
+
+		objects = &next.node->objects;
+		for (j = 0; j < objects->size; j++) {
+			octree_knn_offer(hits, &found, k, OCTREE_OBJECTS_HANDLES(objects)[j],
+					 aabb_distance2(octree_objects_get(objects, j), point));
+		}
+
+		for (i = 0; i < OCTREE_CHILDREN; i++) {
+			octree_t *child = next.node->children[i];
+			float distance;
+			if (!child) continue;
+			distance = aabb_distance2(octree_loosen(child->aabb, octree->state->looseness), point);
+			if (found == (size_t) k && distance >= hits[0].t) continue;
+			if (octree_knn_push(&heap, &size, &capacity, child, distance) < 0) {
+				free(heap);
+				return -1;
+			}
+		}
+	}
+	free(heap);
+
+	// unwind the heap into ascending order and turn squared distances back
+	for (size = found; size > 1; size--) {
+		octree_hit_t worst = hits[0];
+		hits[0] = hits[size - 1];
+		hits[size - 1] = worst;
+		octree_knn_sift(hits, size - 1, 0);
+	}
+	for (size = 0; size < found; size++) {
+		hits[size].t = sqrtf(hits[size].t);
+	}
+	return (int) found;
+}
+
+int
+octree_nearest(octree_t *octree, vec3_t point, octree_hit_t *hit)
+{
+	hit->handle = OCTREE_HANDLE_NONE;
+	hit->t = INFINITY;
+	return octree_knn(octree, point, 1, hit);
+}
+
+/*
+ * Every overlapping pair is found at exactly one place: objects in the
+ * same node, an object against the subtree below its node, or, since
+ * loose siblings overlap, two objects in disjoint subtrees that meet
+ * at their lowest common ancestor as a pair of its children.
+ */
+#define OCTREE_PAIRS_SPLIT (2)
+
+typedef enum octree_pairs_kind_t {
+	OCTREE_PAIRS_LOCAL,    /* a node's objects against itself and below */
+	OCTREE_PAIRS_SUBTREE,  /* everything within a subtree */
+	OCTREE_PAIRS_CROSS     /* two disjoint subtrees against each other */
+} octree_pairs_kind_t;
+
+typedef struct octree_pairs_task_t {
+	octree_pairs_kind_t kind;
+	octree_t *a;
+	octree_t *b;
+} octree_pairs_task_t;
+
+typedef struct octree_pairs_buffer_t {
+	octree_pair_t *pairs;
+	size_t size;
+	size_t capacity;
+} octree_pairs_buffer_t;
+
+typedef struct octree_pairs_t {
+	float looseness;
+	octree_pairs_task_t *tasks;
+	size_t ntasks;
+	size_t tasks_capacity;
+	octree_pairs_buffer_t buffers[PARALLEL_MAXIMUM_THREADS];
+	int failed;
+} octree_pairs_t;
+
+static void
+octree_pairs_emit(octree_pairs_t *pairs, int thread, octree_handle_t a, octree_handle_t b)
+{
+	octree_pairs_buffer_t *buffer = pairs->buffers + thread;
+	if (buffer->size == buffer->capacity) {
+		size_t capacity = buffer->capacity ? buffer->capacity * 2 : 1024;
+		octree_pair_t *resized = realloc(buffer->pairs, capacity * sizeof(*resized));
+		if (!resized) {
+			__atomic_store_n(&pairs->failed, 1, __ATOMIC_RELAXED);
+			return;
+		}
+		buffer->pairs = resized;
+		buffer->capacity = capacity;
+	}
+	buffer->pairs[buffer->size].a = a < b ? a : b;
+	buffer->pairs[buffer->size].b = a < b ? b : a;
+	buffer->size++;
+}
+
+static void
+octree_pairs_object(octree_pairs_t *pairs, int thread, aabb_t aabb, octree_handle_t handle,
+		    octree_t *octree)
+{
+	int i;
+	uint32_t k;
+	for (k = 0; k < octree->objects.size; k++) {
+		if (aabb_overlaps(aabb, octree_objects_get(&octree->objects, k))) {
+			octree_pairs_emit(pairs, thread, handle, OCTREE_OBJECTS_HANDLES(&octree->objects)[k]);
+		}
+	}
+
+	for (i = 0; i < OCTREE_CHILDREN; i++) {
+		octree_t *child = octree->children[i];
+		if (child && aabb_overlaps(aabb, octree_loosen(child->aabb, pairs->looseness))) {
+			octree_pairs_object(pairs, thread, aabb, handle, child);
+		}
+	}
+}
+
+static void
+octree_pairs_local(octree_pairs_t *pairs, int thread, octree_t *octree)
+{
+	int i;
+	uint32_t j, k;
+	octree_objects_t *objects = &octree->objects;
+
+	for (j = 0; j < objects->size; j++) {
+		aabb_t aabb = octree_objects_get(objects, j);
+		octree_handle_t handle = OCTREE_OBJECTS_HANDLES(objects)[j];
+		for (k = j + 1; k < objects->size; k++) {
+			if (aabb_overlaps(aabb, octree_objects_get(objects, k))) {
+				octree_pairs_emit(pairs, thread, handle, OCTREE_OBJECTS_HANDLES(objects)[k]);
+			}
+		}
+
+		for (i = 0; i < OCTREE_CHILDREN; i++) {
+			octree_t *child = octree->children[i];
+			if (child && aabb_overlaps(aabb, octree_loosen(child->aabb, pairs->looseness))) {
+				octree_pairs_object(pairs, thread, aabb, handle, child);
+			}
+		}
+	}
+}
+
+static void
+octree_pairs_cross(octree_pairs_t *pairs, int thread, octree_t *a, octree_t *b)
+{
+	int i, j;
+	uint32_t k;
+
+	// objects of either node against the whole of the other subtree
+	for (k = 0; k < a->objects.size; k++) {
+		aabb_t aabb = octree_objects_get(&a->objects, k);
+		if (aabb_overlaps(aabb, octree_loosen(b->aabb, pairs->looseness))) {
+			octree_pairs_object(pairs, thread, aabb, OCTREE_OBJECTS_HANDLES(&a->objects)[k], b);
+		}
+	}
+	for (i = 0; i < OCTREE_CHILDREN; i++) {
+		if (!a->children[i]) continue;
+		for (k = 0; k < b->objects.size; k++) {
+			aabb_t aabb = octree_objects_get(&b->objects, k);
+			if (aabb_overlaps(aabb, octree_loosen(a->children[i]->aabb, pairs->looseness))) {
+				octree_pairs_object(pairs, thread, aabb, OCTREE_OBJECTS_HANDLES(&b->objects)[k],
+						    a->children[i]);
+			}
+		}
+	}
+
+	for (i = 0; i < OCTREE_CHILDREN; i++) {
+		aabb_t bounds;
+		if (!a->children[i]) continue;
+		bounds = octree_loosen(a->children[i]->aabb, pairs->looseness);
+		for (j = 0; j < OCTREE_CHILDREN; j++) {
+			if (b->children[j]
+			    && aabb_overlaps(bounds, octree_loosen(b->children[j]->aabb, pairs->looseness))) {
+				octree_pairs_cross(pairs, thread, a->children[i], b->children[j]);
+			}
+		}
+	}
+}
+
+static void
+octree_pairs_children(octree_pairs_t *pairs, int thread, octree_t *octree)
+{
+	int i, j;
+	for (i = 0; i < OCTREE_CHILDREN; i++) {
+		aabb_t bounds;
+		if (!octree->children[i]) continue;
+		bounds = octree_loosen(octree->children[i]->aabb, pairs->looseness);
+		for (j = i + 1; j < OCTREE_CHILDREN; j++) {
+			if (octree->children[j]
+			    && aabb_overlaps(bounds, octree_loosen(octree->children[j]->aabb, pairs->looseness))) {
+				octree_pairs_cross(pairs, thread, octree->children[i], octree->children[j]);
+			}
+		}
+	}
+}
+
+static void
+octree_pairs_subtree(octree_pairs_t *pairs, int thread, octree_t *octree)
+{
+	int i;
+	octree_pairs_local(pairs, thread, octree);
+	octree_pairs_children(pairs, thread, octree);
+	for (i = 0; i < OCTREE_CHILDREN; i++) {
+		if (octree->children[i]) {
+			octree_pairs_subtree(pairs, thread, octree->children[i]);
+		}
+	}
+}
+
+static int
+octree_pairs_task(octree_pairs_t *pairs, octree_pairs_kind_t kind, octree_t *a, octree_t *b)
+{
+	if (pairs->ntasks == pairs->tasks_capacity) {
+		size_t capacity = pairs->tasks_capacity ? pairs->tasks_capacity * 2 : 64;
+		octree_pairs_task_t *tasks = realloc(pairs->tasks, capacity * sizeof(*tasks));
+		if (!tasks) return -1;
+		pairs->tasks = tasks;
+		pairs->tasks_capacity = capacity;
+	}
+	pairs->tasks[pairs->ntasks++] = (octree_pairs_task_t) { kind, a, b };
+	return 0;
+}
+
+/* splits the top @depth levels into independent tasks */
+static int
+octree_pairs_split(octree_pairs_t *pairs, octree_t *octree, int depth)
+{
+	int i, j;
+	if (depth == 0) {
+		return octree_pairs_task(pairs, OCTREE_PAIRS_SUBTREE, octree, NULL);
+	}
+
+	if (octree->objects.size > 0 && octree_pairs_task(pairs, OCTREE_PAIRS_LOCAL, octree, NULL) < 0) {
+		return -1;
+	}
+	for (i = 0; i < OCTREE_CHILDREN; i++) {
+		aabb_t bounds;
+		if (!octree->children[i]) continue;
+		bounds = octree_loosen(octree->children[i]->aabb, pairs->looseness);
+		for (j = i + 1; j < OCTREE_CHILDREN; j++) {
+			if (octree->children[j]
+			    && aabb_overlaps(bounds, octree_loosen(octree->children[j]->aabb, pairs->looseness))
+			    && octree_pairs_task(pairs, OCTREE_PAIRS_CROSS, octree->children[i],
+						 octree->children[j]) < 0) {
+				return -1;
+			}
+		}
+		if (octree_pairs_split(pairs, octree->children[i], depth - 1) < 0) {
+			return -1;
+		}
+	}
+	return 0;
+}
+
+static void
+octree_pairs_run(void *arg, size_t index, int thread)
+{
+	octree_pairs_t *pairs = arg;
+	octree_pairs_task_t *task = pairs->tasks + index;
+	switch (task->kind) {
+	case OCTREE_PAIRS_LOCAL:
+		octree_pairs_local(pairs, thread, task->a);
+		break;
+	case OCTREE_PAIRS_SUBTREE:
+		octree_pairs_subtree(pairs, thread, task->a);
+		break;
+	case OCTREE_PAIRS_CROSS:
+		octree_pairs_cross(pairs, thread, task->a, task->b);
+		break;
+	}
+}
+
+int
+octree_collect_pairs(octree_t *octree, int threads, octree_pair_t **result, size_t *count)
+{
+	int i;
+	size_t total = 0;
+	octree_pairs_t pairs;
+
+	*result = NULL;
+	*count = 0;
+	if (threads <= 0) {
+		threads = parallel_threads();
+	}
+	if (threads > PARALLEL_MAXIMUM_THREADS) {
+		threads = PARALLEL_MAXIMUM_THREADS;
+	}
+
+	memset(&pairs, 0, sizeof(pairs));
+	pairs.looseness = octree->state->looseness;
+	if (octree_pairs_split(&pairs, octree, OCTREE_PAIRS_SPLIT) == 0) {
+		parallel_for(pairs.ntasks, threads, octree_pairs_run, &pairs);
+	} else {
+		pairs.failed = 1;
+	}
+
+	for (i = 0; i < threads; i++) {
+		total += pairs.buffers[i].size;
+	}
+	if (!pairs.failed && total > 0 && !(*result = malloc(total * sizeof(**result)))) {
+		pairs.failed = 1;
+	}
+
+	for (i = 0; i < threads; i++) {
+		// empty buffers were never allocated, and memcpy() wants a valid source
+		if (!pairs.failed && pairs.buffers[i].size > 0) {
+			memcpy(*result + *count, pairs.buffers[i].pairs,
+			       pairs.buffers[i].size * sizeof(**result));
+			*count += pairs.buffers[i].size;
+		}
+		free(pairs.buffers[i].pairs);
+	}
+	free(pairs.tasks);
+	return pairs.failed ? -1 : 0;
+}
+
+// frees empty child leaves and pulls underfull leaves back into @octree
+static void
+octree_collapse(octree_t *octree)
+{
+	int i, leaves = 1;
+	size_t total = octree->objects.size;
+	for (i = 0; i < OCTREE_CHILDREN; i++) {
+		octree_t *child = octree->children[i];
+		if (!child) continue;
+		if (!octree_is_leaf(child)) {
+			leaves = 0;
+		} else if (child->objects.size == 0) {
+			octree_free(child);
+			octree->children[i] = NULL;
+			continue;
+		}
+		total += child->objects.size;
+	}
+
+	if (!leaves || total > OCTREE_COLLAPSE_THRESHOLD(octree->state->split)
+	    || octree_objects_reserve(octree, total) < 0) {
+		return;
+	}
+
+	for (i = 0; i < OCTREE_CHILDREN; i++) {
+		uint32_t j;
+		octree_t *child = octree->children[i];
+		if (!child) continue;
+		for (j = 0; j < child->objects.size; j++) {
+			octree_objects_push(octree, octree_objects_get(&child->objects, j),
+					    OCTREE_OBJECTS_HANDLES(&child->objects)[j]);
+		}
+		octree_free(child);
+		octree->children[i] = NULL;
+	}
+}
+
+// collapses every ancestor of @octree, which may free @octree itself
+static void
+octree_collapse_path(octree_t *octree)
+{
+	for (octree = octree->parent; octree; octree = octree->parent) {
+		octree_collapse(octree);
+	}
+}
+
+int
+octree_remove(octree_t *octree, octree_handle_t handle)
+{
+	octree_t *node;
+	octree_entry_t *entry = octree_entry(octree, handle);
+	if (!entry) {
+		return -1;
+	}
+
+	node = entry->node;
+	octree_objects_remove(node, entry->slot);
+	octree_entry_release(octree->state, handle);
+	octree_collapse_path(node);
+	return 0;
+}
+
+// children are stacked last first, so they are searched in octant order
+static octree_handle_t
+octree_lookup(octree_t *octree, aabb_t aabb)
+{
+	int i, size = 1;
+	octree_t *stack[OCTREE_STACK];
+
+	stack[0] = octree;
+	while (size > 0) {
+		octree = stack[--size];
+		i = octree_objects_index(&octree->objects, aabb);
+		if (i >= 0) {
+			return OCTREE_OBJECTS_HANDLES(&octree->objects)[i];
+		}
+
+		for (i = OCTREE_CHILDREN - 1; i >= 0; i--) {
+			octree_t *child = octree->children[i];
+			if (child && aabb_contains(octree_loosen(child->aabb, octree->state->looseness), aabb)) {
+				stack[size++] = child;
+			}
+		}
+	}
+	return OCTREE_HANDLE_NONE;
+}
+
+int
+octree_remove_aabb(octree_t *octree, aabb_t aabb)
+{
+	return octree_remove(octree, octree_lookup(octree, aabb));
+}
+
+int
+octree_update(octree_t *octree, octree_handle_t handle, aabb_t aabb)
+{
+	int k;
+	octree_t *node;
+	octree_entry_t *entry = octree_entry(octree, handle);
+	if (!entry) {
+		return -1;
+	}
+
+	node = entry->node;
+	if (node == octree->state->root
+	    || octree_contains(octree_loosen(node->aabb, octree->state->looseness), aabb)) {
+		for (k = 0; k < 3; k++) {
+			OCTREE_OBJECTS_MIN(&node->objects, k)[entry->slot] = aabb.min.data[k];
+			OCTREE_OBJECTS_MAX(&node->objects, k)[entry->slot] = aabb.max.data[k];
+		}
+		return 0;
+	}
+
+	octree_objects_remove(node, entry->slot);
+	octree_collapse_path(node);
+	if (octree_insert_internal(octree->state->root, aabb, handle, 0) < 0) {
+		octree_entry_release(octree->state, handle);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+octree_free_internal(octree_t *octree)
+{
+	int i, size = 1;
+	octree_t *stack[OCTREE_STACK];
+	if (octree == NULL) return;
+
+	stack[0] = octree;
+	while (size > 0) {
+		octree = stack[--size];
+		for (i = 0; i < OCTREE_CHILDREN; i++) {
+			if (octree->children[i]) stack[size++] = octree->children[i];
+		}
+
+		octree_object_release(octree, octree->objects.data,
+				      OCTREE_OBJECTS_BYTES(octree->objects.capacity));
+		if (octree->state->arena) {
+			arena_release(octree->state->arena, octree, sizeof(*octree));
+		} else {
+			free(octree);
+		}
+	}
+}
+
+void
+octree_free(octree_t *octree)
+{
+	octree_state_t *state;
+	if (octree == NULL) return;
+	state = octree->state;
+	octree_free_internal(octree);
+	if (octree == state->root) {
+		octree_state_free(state);
+	}
+}
+
+static void
+octree_render_box(const octree_render_t *render, aabb_t aabb, GLenum mode, GLsizei count)
+{
+	ll_matrix_mode(LL_MATRIX_MODEL);
+	ll_matrix_identity();
+	ll_matrix_scale3f(aabb.max.x-aabb.min.x,
+			  aabb.max.y-aabb.min.y,
+			  aabb.max.z-aabb.min.z);
+	ll_matrix_translate3fv(aabb.min);
+	glUniformMatrix4fv(render->model, 1, GL_FALSE, ll_matrix_get_copy().data);
+	glDrawElements(mode, count, GL_UNSIGNED_INT, NULL);
+}
+
+void
+octree_render_begin(octree_t *octree, octree_render_t *render)
+{
+	mat4_t projection, view;
+
+	glUseProgram(aabb_shader);
+	ll_matrix_mode(LL_MATRIX_PROJECTION);
+	projection = ll_matrix_get_copy();
+	glUniformMatrix4fv(glGetUniformLocation(aabb_shader, "projection"),
+			   1, GL_FALSE, projection.data);
+	ll_matrix_mode(LL_MATRIX_VIEW);
+	view = ll_matrix_get_copy();
+	glUniformMatrix4fv(glGetUniformLocation(aabb_shader, "view"),
+			   1, GL_FALSE, view.data);
+	glUniform4f(glGetUniformLocation(aabb_shader, "colour"),
+		    1.0, 1.0, 1.0, 1.0);
+	glUseProgram(0);
+
+	render->frustum = frustum_create(view, projection);
+	render->model = glGetUniformLocation(aabb_shader, "model");
+	// the root is always visited, update() may leave objects outside it
+	render->stack[0] = octree;
+	render->masks[0] = FRUSTUM_MASK_ALL;
+	render->size = 1;
+}
+
+/*
+ * A stacked node's mask holds the frustum planes it still straddles,
+ * once it is empty the node and everything below it are drawn without
+ * tests.
+ */
+int
+octree_render_step(octree_render_t *render, size_t budget)
+{
+	int i, mask, inner;
+	uint32_t k;
+
+	glUseProgram(aabb_shader);
+	glBindVertexArray(aabb_buffers[AABB_BUFFER_VAO]);
+	for (; budget > 0 && render->size > 0; budget--) {
+		octree_t *octree = render->stack[--render->size];
+		mask = render->masks[render->size];
+
+		octree_render_box(render, octree->aabb, GL_LINES, 36);
+		for (k = 0; k < octree->objects.size; k++) {
+			aabb_t aabb = octree_objects_get(&octree->objects, k);
+			inner = mask;
+			if (mask && frustum_aabb_masked(&render->frustum, aabb, &inner)
+			    == FRUSTUM_OUTSIDE) continue;
+			octree_render_box(render, aabb, GL_TRIANGLES, 24);
+		}
+
+		// stacked last to first so children are drawn in order
+		for (i = OCTREE_CHILDREN; i-- > 0;) {
+			octree_t *child = octree->children[i];
+			if (!child) continue;
+			inner = mask;
+			if (mask && frustum_aabb_masked(&render->frustum,
+							octree_loosen(child->aabb, octree->state->looseness),
+							&inner) == FRUSTUM_OUTSIDE) continue;
+			render->stack[render->size] = child;
+			render->masks[render->size++] = inner;
+		}
+	}
+	glBindVertexArray(0);
+	glUseProgram(0);
+	return render->size > 0;
+}
+
+void
+octree_render(octree_t *octree)
+{
+	octree_render_t render;
+	octree_render_begin(octree, &render);
+	octree_render_step(&render, SIZE_MAX);
+}
+
+
+aabb_t
+octree_loose_bounds(const octree_t *octree)
+{
+	return octree_loosen(octree->aabb, octree->state->looseness);
+}
+
+void
+octree_memory(octree_t *octree, octree_memory_t *memory)
+{
+	int i;
+	if (octree == NULL) return;
+	memory->nodes++;
+	memory->objects += octree->objects.size;
+	memory->node_bytes += sizeof(*octree);
+	memory->object_bytes += OCTREE_OBJECTS_BYTES(octree->objects.capacity);
+	// snapshot versions replace their root, the table belongs to whichever has no parent
+	if (!octree->parent) {
+		memory->entry_bytes += octree->state->entries_capacity * sizeof(octree_entry_t);
+	}
+	for (i = 0; i < OCTREE_CHILDREN; i++) {
+		octree_memory(octree->children[i], memory);
+	}
+}
+
+// the node layout before objects were stored out of line
+#define OCTREE_FIXED_NODE_BYTES (sizeof(aabb_t) + sizeof(size_t)		\
+				 + 100 * sizeof(aabb_t)			\
+				 + OCTREE_CHILDREN * sizeof(octree_t *))
+
+void
+octree_memory_print(octree_t *octree, FILE *stream)
+{
+	size_t bytes, fixed_bytes, objects;
+	octree_memory_t memory = {0};
+	octree_memory(octree, &memory);
+	bytes = memory.node_bytes + memory.object_bytes + memory.entry_bytes;
+	fixed_bytes = memory.nodes * OCTREE_FIXED_NODE_BYTES;
+	objects = memory.objects ? memory.objects : 1;
+	fprintf(stream, "octree: %zu nodes, %zu objects\n", memory.nodes, memory.objects);
+	fprintf(stream, "octree: %zu bytes (%zu nodes + %zu objects + %zu handles), %.1f bytes/object\n",
+		bytes, memory.node_bytes, memory.object_bytes, memory.entry_bytes,
+		(double) bytes / objects);
+	fprintf(stream, "octree: fixed layout would take %zu bytes, %.1f bytes/object\n",
+		fixed_bytes, (double) fixed_bytes / objects);
+}
+
+octree_snapshot_t *
+octree_snapshot_create(aabb_t aabb, float looseness)
+{
+	octree_snapshot_t *snapshot;
+	snapshot = aligned_alloc(64, sizeof(*snapshot));
+	if (!snapshot) {
+		return NULL;
+	}
+
+	memset(snapshot, 0, sizeof(*snapshot));
+	snapshot->epoch = 1;
+	snapshot->root = octree_create(aabb, NULL);
+	if (!snapshot->root || octree_set_looseness(snapshot->root, looseness) < 0) {
+		octree_free(snapshot->root);
+		free(snapshot);
+		return NULL;
+	}
+	// versions replace the root, snapshot->root is the only one kept track of
+	snapshot->root->state->root = NULL;
+	return snapshot;
+}
+
+static int
+octree_snapshot_retire_reserve(octree_snapshot_t *snapshot, size_t n)
+{
+	octree_retired_t *retired;
+	size_t capacity = snapshot->retired_capacity ? snapshot->retired_capacity : 64;
+	if (snapshot->nretired + n <= snapshot->retired_capacity) {
+		return 0;
+	}
+
+	while (capacity < snapshot->nretired + n) capacity *= 2;
+	retired = realloc(snapshot->retired, capacity * sizeof(*retired));
+	if (!retired) {
+		return -1;
+	}
+	snapshot->retired = retired;
+	snapshot->retired_capacity = capacity;
+	return 0;
+}
+
+static void
+octree_snapshot_retire(octree_snapshot_t *snapshot, void *ptr)
+{
+	if (ptr) {
+		snapshot->retired[snapshot->nretired].ptr = ptr;
+		snapshot->retired[snapshot->nretired].epoch = snapshot->epoch;
+		snapshot->nretired++;
+	}
+}
+
+/*
+ * A reader that pinned epoch e may hold any root published before the
+ * epoch moved past e, so what was retired in e is only freed once every
+ * pinned epoch is newer.
+ */
+static void
+octree_snapshot_reclaim(octree_snapshot_t *snapshot)
+{
+	int i;
+	size_t j, kept = 0;
+	uint64_t oldest = snapshot->epoch;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (i = 0; i < OCTREE_SNAPSHOT_READERS; i++) {
+		uint64_t epoch = __atomic_load_n(&snapshot->readers[i].epoch, __ATOMIC_ACQUIRE);
+		if (epoch && epoch < oldest) oldest = epoch;
+	}
+
+	for (j = 0; j < snapshot->nretired; j++) {
+		if (snapshot->retired[j].epoch < oldest) {
+			free(snapshot->retired[j].ptr);
+		} else {
+			snapshot->retired[kept++] = snapshot->retired[j];
+		}
+	}
+	snapshot->nretired = kept;
+}
+
+/* publishes @root and retires the @n replaced nodes or blocks in @old */
+static void
+octree_snapshot_publish(octree_snapshot_t *snapshot, octree_t *root, void **old, int n)
+{
+	int i;
+	__atomic_store_n(&snapshot->root, root, __ATOMIC_RELEASE);
+	for (i = 0; i < n; i++) {
+		octree_snapshot_retire(snapshot, old[i]);
+	}
+	__atomic_store_n(&snapshot->epoch, snapshot->epoch + 1, __ATOMIC_SEQ_CST);
+	octree_snapshot_reclaim(snapshot);
+}
+
+static octree_t *
+octree_snapshot_copy(const octree_t *octree)
+{
+	octree_t *copy = malloc(sizeof(*copy));
+	if (copy) {
+		*copy = *octree;
+		copy->lock = 0;
+	}
+	return copy;
+}
+
+static void
+octree_snapshot_discard(octree_t **copies, int n, float *data)
+{
+	int i;
+	for (i = 0; i < n; i++) {
+		free(copies[i]);
+	}
+	free(data);
+}
+
+/* as octree_objects_push() into a node of an unpublished version, which has no handle table */
+static int
+octree_snapshot_push(octree_t *octree, aabb_t aabb, octree_handle_t handle)
+{
+	int k;
+	octree_objects_t *objects = &octree->objects;
+	if (objects->size == objects->capacity
+	    && octree_objects_reserve(octree, objects->capacity
+				      ? objects->capacity * 2
+				      : OCTREE_OBJECTS_MINIMUM) < 0) {
+		return -1;
+	}
+
+	for (k = 0; k < 3; k++) {
+		OCTREE_OBJECTS_MIN(objects, k)[objects->size] = aabb.min.data[k];
+		OCTREE_OBJECTS_MAX(objects, k)[objects->size] = aabb.max.data[k];
+	}
+	OCTREE_OBJECTS_HANDLES(objects)[objects->size++] = handle;
+	return 0;
+}
+
+/*
+ * Splits the leaf @octree of an unpublished version as octree_split()
+ * does. The caller gives the leaf a block of its own first, so it and
+ * every new child below it can be changed in place. A failed
+ * allocation leaves the objects not yet moved where they were.
+ */
+static void
+octree_snapshot_split(octree_t *octree, int level)
+{
+	int i, failed, size = 1, levels[OCTREE_STACK];
+	uint32_t j, kept;
+	octree_t *child, *stack[OCTREE_STACK];
+	octree_state_t *state = octree->state;
+
+	stack[0] = octree;
+	levels[0] = level;
+	while (size > 0) {
+		octree_objects_t *objects;
+		octree = stack[--size];
+		level = levels[size];
+		objects = &octree->objects;
+
+		for (j = 0, kept = 0, failed = 0; j < objects->size; j++) {
+			aabb_t aabb = octree_objects_get(objects, j);
+			i = failed ? -1 : octree_insert_octant(octree, aabb, level);
+			if (i >= 0 && !(child = octree->children[i])) {
+				child = octree_node_create(octree_quadrant(octree->aabb, i), octree, state);
+				octree->children[i] = child;
+			}
+			if (i >= 0 && child
+			    && octree_snapshot_push(child, aabb, OCTREE_OBJECTS_HANDLES(objects)[j]) == 0) {
+				continue;
+			}
+			failed |= i >= 0;
+
+			if (kept != j) {
+				octree_objects_move(objects, kept, j);
+			}
+			kept++;
+		}
+		objects->size = kept;
+		octree_objects_shrink(octree);
+
+		for (i = 0; i < OCTREE_CHILDREN; i++) {
+			child = octree->children[i];
+			if (child && child->objects.size > state->split && level + 1 < state->depth) {
+				stack[size] = child;
+				levels[size++] = level + 1;
+			}
+		}
+	}
+}
+
+octree_handle_t
+octree_snapshot_insert(octree_snapshot_t *snapshot, aabb_t aabb)
+{
+	int i, k, depth = 0;
+	octree_t *node = snapshot->root, *target;
+	octree_t *copies[OCTREE_MAXIMUM_DEPTH + 1];
+	int octants[OCTREE_MAXIMUM_DEPTH + 1];
+	void *old[OCTREE_MAXIMUM_DEPTH + 2];
+	float *data = NULL, *replaced = NULL;
+	octree_handle_t handle = snapshot->nboxes;
+	aabb_t bounds = node->aabb;
+
+	if (handle == OCTREE_HANDLE_NONE
+	    || octree_snapshot_retire_reserve(snapshot, OCTREE_MAXIMUM_DEPTH + 3) < 0) {
+		return OCTREE_HANDLE_NONE;
+	}
+
+	// readers may be looking boxes up, so a full array is copied and retired
+	if (handle == snapshot->boxes_capacity) {
+		uint32_t capacity = snapshot->boxes_capacity ? snapshot->boxes_capacity * 2 : 64;
+		aabb_t *boxes = malloc(capacity * sizeof(*boxes));
+		if (!boxes) {
+			return OCTREE_HANDLE_NONE;
+		}
+		if (handle > 0) {
+			memcpy(boxes, snapshot->boxes, handle * sizeof(*boxes));
+		}
+		octree_snapshot_retire(snapshot, snapshot->boxes);
+		__atomic_store_n(&snapshot->boxes, boxes, __ATOMIC_RELEASE);
+		snapshot->boxes_capacity = capacity;
+	}
+
+	// copy the path down to the leaf, as octree_insert() descends, starting
+	// a fresh leaf where a child is missing
+	for (;;) {
+		copies[depth] = node ? octree_snapshot_copy(node)
+			: octree_node_create(bounds, NULL, snapshot->root->state);
+		if (!copies[depth]) {
+			octree_snapshot_discard(copies, depth, NULL);
+			return OCTREE_HANDLE_NONE;
+		}
+		old[depth] = node;
+		if (octree_is_leaf(copies[depth])) break;
+
+		i = octree_insert_octant(copies[depth], aabb, depth);
+		if (i < 0) break;
+		octants[depth] = i;
+		bounds = octree_quadrant(copies[depth]->aabb, i);
+		node = copies[depth]->children[i];
+		depth++;
+	}
+
+	// older versions only read below their own size, so the slot past
+	// it is free to fill in place until the block has to grow
+	target = copies[depth];
+	if (target->objects.size == target->objects.capacity) {
+		uint32_t capacity = target->objects.capacity ? target->objects.capacity * 2
+			: OCTREE_OBJECTS_MINIMUM;
+		data = malloc(OCTREE_OBJECTS_BYTES(capacity));
+		if (!data) {
+			octree_snapshot_discard(copies, depth + 1, NULL);
+			return OCTREE_HANDLE_NONE;
+		}
+		for (k = 0; k < OCTREE_OBJECTS_ARRAYS && target->objects.size; k++) {
+			memcpy(data + k * capacity, target->objects.data + k * target->objects.capacity,
+			       target->objects.size * sizeof(*data));
+		}
+		replaced = target->objects.data;
+		target->objects.data = data;
+		target->objects.capacity = capacity;
+	}
+
+	for (k = 0; k < 3; k++) {
+		OCTREE_OBJECTS_MIN(&target->objects, k)[target->objects.size] = aabb.min.data[k];
+		OCTREE_OBJECTS_MAX(&target->objects, k)[target->objects.size] = aabb.max.data[k];
+	}
+	OCTREE_OBJECTS_HANDLES(&target->objects)[target->objects.size++] = handle;
+
+	// splitting packs the leaf's block, so it needs one older versions do not read
+	if (octree_is_leaf(target) && octree_split_due(target, depth)) {
+		if (!replaced && (data = malloc(OCTREE_OBJECTS_BYTES(target->objects.capacity)))) {
+			for (k = 0; k < OCTREE_OBJECTS_ARRAYS; k++) {
+				memcpy(data + k * target->objects.capacity,
+				       target->objects.data + k * target->objects.capacity,
+				       target->objects.size * sizeof(*data));
+			}
+			replaced = target->objects.data;
+			target->objects.data = data;
+		}
+		if (replaced) {
+			octree_snapshot_split(target, depth);
+		}
+	}
+
+	copies[0]->parent = NULL;
+	for (i = 0; i < depth; i++) {
+		copies[i]->children[octants[i]] = copies[i+1];
+		copies[i+1]->parent = copies[i];
+	}
+
+	snapshot->boxes[handle] = aabb;
+	__atomic_store_n(&snapshot->nboxes, handle + 1, __ATOMIC_RELEASE);
+	old[depth + 1] = replaced;
+	octree_snapshot_publish(snapshot, copies[0], old, depth + 2);
+	return handle;
+}
+
+static int
+octree_snapshot_path(octree_t *octree, aabb_t aabb, octree_handle_t handle,
+		     octree_t **path, int *octants)
+{
+	int i, depth, size = 1, depths[OCTREE_STACK], parents[OCTREE_STACK];
+	uint32_t k;
+	octree_t *stack[OCTREE_STACK];
+
+	stack[0] = octree;
+	depths[0] = 0;
+	parents[0] = 0;
+	while (size > 0) {
+		octree = stack[--size];
+		depth = depths[size];
+		// siblings popped later overwrite this depth, so path[] always holds the ancestors
+		path[depth] = octree;
+		if (depth > 0) {
+			octants[depth-1] = parents[size];
+		}
+		for (k = 0; k < octree->objects.size; k++) {
+			if (OCTREE_OBJECTS_HANDLES(&octree->objects)[k] == handle) {
+				octants[depth] = k;
+				return depth;
+			}
+		}
+
+		for (i = OCTREE_CHILDREN - 1; i >= 0; i--) {
+			octree_t *child = octree->children[i];
+			if (child && aabb_contains(octree_loosen(child->aabb, octree->state->looseness), aabb)) {
+				stack[size] = child;
+				depths[size] = depth + 1;
+				parents[size++] = i;
+			}
+		}
+	}
+	return -1;
+}
+
+int
+octree_snapshot_remove(octree_snapshot_t *snapshot, octree_handle_t handle)
+{
+	int i, k, n, depth;
+	uint32_t slot, size, capacity;
+	octree_t *path[OCTREE_MAXIMUM_DEPTH + 1], *copies[OCTREE_MAXIMUM_DEPTH + 1], *target;
+	int octants[OCTREE_MAXIMUM_DEPTH + 1];
+	void *old[OCTREE_MAXIMUM_DEPTH + 2];
+	float *data = NULL;
+	aabb_t aabb;
+
+	if (handle >= snapshot->nboxes) {
+		return -1;
+	}
+	// boxes outlive their removal, a removed handle is simply not found
+	aabb = snapshot->boxes[handle];
+	if ((depth = octree_snapshot_path(snapshot->root, aabb, handle, path, octants)) < 0) {
+		return -1;
+	}
+	if (octree_snapshot_retire_reserve(snapshot, depth + 2) < 0) {
+		return -1;
+	}
+
+	for (i = 0; i <= depth; i++) {
+		if (!(copies[i] = octree_snapshot_copy(path[i]))) {
+			octree_snapshot_discard(copies, i, NULL);
+			return -1;
+		}
+		old[i] = path[i];
+	}
+
+	// the block is shared with the versions readers hold, so removal
+	// writes a new one rather than swapping in place
+	target = copies[depth];
+	slot = octants[depth];
+	size = target->objects.size - 1;
+	capacity = target->objects.capacity;
+	if (size * 4 <= capacity && capacity > OCTREE_OBJECTS_MINIMUM) {
+		capacity /= 2;
+	}
+	if (size > 0) {
+		if (!(data = malloc(OCTREE_OBJECTS_BYTES(capacity)))) {
+			octree_snapshot_discard(copies, depth + 1, NULL);
+			return -1;
+		}
+		// the halved capacity still has room for the object being dropped
+		for (k = 0; k < OCTREE_OBJECTS_ARRAYS; k++) {
+			memcpy(data + k * capacity, target->objects.data + k * target->objects.capacity,
+			       (size + 1) * sizeof(*data));
+		}
+	}
+	old[depth + 1] = target->objects.data;
+	n = depth + 2;
+	target->objects.data = data;
+	target->objects.size = size;
+	target->objects.capacity = size > 0 ? capacity : 0;
+	if (size > 0) {
+		octree_objects_move(&target->objects, slot, size);
+	}
+
+	// drop copies that are left as empty leaves
+	while (depth > 0 && copies[depth]->objects.size == 0 && octree_is_leaf(copies[depth])) {
+		free(copies[depth--]);
+		copies[depth]->children[octants[depth]] = NULL;
+	}
+
+	copies[0]->parent = NULL;
+	for (i = 0; i < depth; i++) {
+		copies[i]->children[octants[i]] = copies[i+1];
+		copies[i+1]->parent = copies[i];
+	}
+	octree_snapshot_publish(snapshot, copies[0], old, n);
+	return 0;
+}
+
+int
+octree_snapshot_reader(octree_snapshot_t *snapshot)
+{
+	int i, expected;
+	for (i = 0; i < OCTREE_SNAPSHOT_READERS; i++) {
+		expected = 0;
+		if (__atomic_compare_exchange_n(&snapshot->readers[i].claimed, &expected, 1, 0,
+						__ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+void
+octree_snapshot_reader_release(octree_snapshot_t *snapshot, int reader)
+{
+	__atomic_store_n(&snapshot->readers[reader].epoch, 0, __ATOMIC_RELEASE);
+	__atomic_store_n(&snapshot->readers[reader].claimed, 0, __ATOMIC_RELEASE);
+}
+
+octree_t *
+octree_snapshot_enter(octree_snapshot_t *snapshot, int reader)
+{
+	// pin before taking the root; paired with the fence in reclaim,
+	// either the writer sees the pin or this sees the newer root
+	__atomic_store_n(&snapshot->readers[reader].epoch,
+			 __atomic_load_n(&snapshot->epoch, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return __atomic_load_n(&snapshot->root, __ATOMIC_ACQUIRE);
+}
+
+void
+octree_snapshot_leave(octree_snapshot_t *snapshot, int reader)
+{
+	__atomic_store_n(&snapshot->readers[reader].epoch, 0, __ATOMIC_RELEASE);
+}
+
+aabb_t
+octree_snapshot_get(octree_snapshot_t *snapshot, octree_handle_t handle)
+{
+	// the count is stored after the box and any newer array, so both are seen
+	if (handle >= __atomic_load_n(&snapshot->nboxes, __ATOMIC_ACQUIRE)) {
+		return aabb_empty();
+	}
+	return __atomic_load_n(&snapshot->boxes, __ATOMIC_ACQUIRE)[handle];
+}
+
+void
+octree_snapshot_free(octree_snapshot_t *snapshot)
+{
+	size_t i;
+	octree_state_t *state;
+	if (!snapshot) return;
+
+	for (i = 0; i < snapshot->nretired; i++) {
+		free(snapshot->retired[i].ptr);
+	}
+	state = snapshot->root->state;
+	octree_free_internal(snapshot->root);
+	octree_state_free(state);
+	free(snapshot->retired);
+	free(snapshot->boxes);
+	free(snapshot);
+}
@@ -0,0 +1,235 @@
+#include "../include/parallel.h"
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+typedef struct parallel_job_t {
+	size_t n;
+	size_t next;
+	parallel_fn_t fn;
+	void *arg;
+} parallel_job_t;
+
+typedef struct parallel_worker_t {
+	parallel_job_t *job;
+	int thread;
+} parallel_worker_t;
+
+int
+parallel_threads(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n < 1) return 1;
+	if (n > PARALLEL_MAXIMUM_THREADS) return PARALLEL_MAXIMUM_THREADS;
+	return (int) n;
+}
+
+static void *
+parallel_run(void *arg)
+{
+	size_t i;
+	parallel_worker_t *worker = arg;
+	parallel_job_t *job = worker->job;
+	while ((i = __atomic_fetch_add(&job->next, 1, __ATOMIC_RELAXED)) < job->n) {
+		job->fn(job->arg, i, worker->thread);
+	}
+	return NULL;
+}
+
+void
+parallel_for(size_t n, int threads, parallel_fn_t fn, void *arg)
+{
+	int i, started;
+	pthread_t tids[PARALLEL_MAXIMUM_THREADS];
+	parallel_worker_t workers[PARALLEL_MAXIMUM_THREADS];
+	parallel_job_t job = { n, 0, fn, arg };
+
+	if (threads <= 0) {
+		threads = parallel_threads();
+	}
+	if (threads > PARALLEL_MAXIMUM_THREADS) {
+		threads = PARALLEL_MAXIMUM_THREADS;
+	}
+	if ((size_t) threads > n) {
+		threads = n ? (int) n : 1;
+	}
+
+	for (i = 0; i < threads; i++) {
+		workers[i].job = &job;
+		workers[i].thread = i;
+	}
+
+	// a worker that fails to start just leaves its share to the others
+	for (started = 1; started < threads; started++) {
+		if (pthread_create(tids+started, NULL, parallel_run, workers+started) != 0) {
+			break;
+		}
+	}
+
+	parallel_run(workers);
+	for (i = 1; i < started; i++) {
+		pthread_join(tids[i], NULL);
+	}
+}
+
+/*
+ * A Chase-Lev deque that is filled before the workers start, so only
+ * pops by the owner and steals by everyone else remain. The indices
+ * are padded apart to keep workers off each other's cache lines.
+ */
+typedef struct parallel_deque_t {
+	long top __attribute__((aligned(64)));
+	long bottom __attribute__((aligned(64)));
+	size_t *chunks;
+} parallel_deque_t;
+
+typedef struct parallel_steal_t {
+	size_t n;
+	size_t grain;
+	int threads;
+	parallel_fn_t fn;
+	void *arg;
+	parallel_deque_t *deques;
+} parallel_steal_t;
+
+typedef struct parallel_thief_t {
+	parallel_steal_t *steal;
+	int thread;
+} parallel_thief_t;
+
+static int
+parallel_deque_pop(parallel_deque_t *deque, size_t *chunk)
+{
+	long top, bottom = __atomic_load_n(&deque->bottom, __ATOMIC_RELAXED) - 1;
+	int taken = 1;
+
+	__atomic_store_n(&deque->bottom, bottom, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	top = __atomic_load_n(&deque->top, __ATOMIC_RELAXED);
+	if (top > bottom) {
+		__atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+		return 0;
+	}
+
+	*chunk = deque->chunks[bottom];
+	if (top == bottom) {
+		// the last chunk, race the thieves for it
+		taken = __atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+						    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+		__atomic_store_n(&deque->bottom, bottom + 1, __ATOMIC_RELAXED);
+	}
+	return taken;
+}
+
+/* @return 1 with a chunk, 0 when empty, -1 when another thread won */
+static int
+parallel_deque_steal(parallel_deque_t *deque, size_t *chunk)
+{
+	long top = __atomic_load_n(&deque->top, __ATOMIC_ACQUIRE), bottom;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	bottom = __atomic_load_n(&deque->bottom, __ATOMIC_ACQUIRE);
+	if (top >= bottom) return 0;
+
+	*chunk = deque->chunks[top];
+	if (!__atomic_compare_exchange_n(&deque->top, &top, top + 1, 0,
+					 __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)) {
+		return -1;
+	}
+	return 1;
+}
+
+static void *
+parallel_steal_run(void *arg)
+{
+	int i, contended;
+	size_t chunk = 0, index, end;
+	parallel_thief_t *thief = arg;
+	parallel_steal_t *steal = thief->steal;
+
+	for (;;) {
+		if (!parallel_deque_pop(steal->deques + thief->thread, &chunk)) {
+			// nothing is ever pushed, so a clean sweep means all done
+			do {
+				contended = 0;
+				for (i = 1; i < steal->threads; i++) {
+					int r = parallel_deque_steal(steal->deques
+								     + (thief->thread + i) % steal->threads, &chunk);
+					if (r > 0) break;
+					contended |= r < 0;
+				}
+			} while (i == steal->threads && contended);
+			if (i == steal->threads) return NULL;
+		}
+
+		end = (chunk + 1) * steal->grain < steal->n ? (chunk + 1) * steal->grain : steal->n;
+		for (index = chunk * steal->grain; index < end; index++) {
+			steal->fn(steal->arg, index, thief->thread);
+		}
+	}
+}
+
+void
+parallel_steal(size_t n, size_t grain, int threads, parallel_fn_t fn, void *arg)
+{
+	int i, started;
+	size_t index, chunk, chunks, *order;
+	pthread_t tids[PARALLEL_MAXIMUM_THREADS];
+	parallel_thief_t thieves[PARALLEL_MAXIMUM_THREADS];
+	parallel_deque_t *deques;
+	parallel_steal_t steal;
+
+	if (grain == 0) grain = 1;
+	chunks = (n + grain - 1) / grain;
+	if (threads <= 0) {
+		threads = parallel_threads();
+	}
+	if (threads > PARALLEL_MAXIMUM_THREADS) {
+		threads = PARALLEL_MAXIMUM_THREADS;
+	}
+	if ((size_t) threads > chunks) {
+		threads = chunks ? (int) chunks : 1;
+	}
+
+	order = malloc(chunks * sizeof(*order));
+	deques = aligned_alloc(64, threads * sizeof(*deques));
+	if (!order || !deques) {
+		// still get the work done, just without the deques
+		free(order);
+		free(deques);
+		for (index = 0; index < n; index++) {
+			fn(arg, index, 0);
+		}
+		return;
+	}
+
+	// worker i owns a contiguous run, popped front to back
+	for (i = 0; i < threads; i++) {
+		size_t lo = chunks * i / threads, hi = chunks * (i + 1) / threads;
+		deques[i].top = 0;
+		deques[i].bottom = hi - lo;
+		deques[i].chunks = order + lo;
+		for (chunk = lo; chunk < hi; chunk++) {
+			order[lo + hi - 1 - chunk] = chunk;
+		}
+	}
+
+	steal = (parallel_steal_t) { n, grain, threads, fn, arg, deques };
+	for (i = 0; i < threads; i++) {
+		thieves[i].steal = &steal;
+		thieves[i].thread = i;
+	}
+
+	// a worker that fails to start leaves its deque to the thieves
+	for (started = 1; started < threads; started++) {
+		if (pthread_create(tids+started, NULL, parallel_steal_run, thieves+started) != 0) {
+			break;
+		}
+	}
+
+	parallel_steal_run(thieves);
+	for (i = 1; i < started; i++) {
+		pthread_join(tids[i], NULL);
+	}
+	free(deques);
+	free(order);
+}
@@ -0,0 +1,205 @@
+#include "../include/query.h"
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// candidates tried by query_tune(), every depth with every split
+static const int query_tune_depths[] = { 4, 6, 8, 10, 12, 14, 16 };
+static const uint32_t query_tune_splits[] = { 1, 4, 16, 64, 256 };
+
+typedef struct query_run_t {
+	query_executor_t *executor;
+	octree_t *octree;
+	const query_t *queries;
+	query_result_t *results;
+} query_run_t;
+
+query_executor_t *
+query_executor_create(int threads)
+{
+	int i;
+	query_executor_t *executor;
+
+	if (threads <= 0) {
+		threads = parallel_threads();
+	}
+	if (threads > PARALLEL_MAXIMUM_THREADS) {
+		threads = PARALLEL_MAXIMUM_THREADS;
+	}
+
+	executor = aligned_alloc(64, sizeof(*executor));
+	if (!executor) {
+		return NULL;
+	}
+	memset(executor, 0, sizeof(*executor));
+
+	executor->threads = threads;
+	for (i = 0; i < threads; i++) {
+		if (!(executor->workers[i].arena = arena_create(0))) {
+			query_executor_free(executor);
+			return NULL;
+		}
+	}
+	return executor;
+}
+
+static int
+query_region(const query_t *query, octree_t *octree, octree_scratch_t *scratch)
+{
+	switch (query->type) {
+	case QUERY_AABB:
+		return octree_query_aabb_into(octree, query->aabb, scratch);
+	case QUERY_SPHERE:
+		return octree_query_sphere_into(octree, query->sphere.centre, query->sphere.radius,
+						scratch);
+	case QUERY_FRUSTUM:
+		return octree_query_frustum_into(octree, query->frustum, scratch);
+	default:
+		scratch->count = 0;
+		return 0;
+	}
+}
+
+static void
+query_run(void *arg, size_t index, int thread)
+{
+	size_t count;
+	query_run_t *run = arg;
+	query_worker_t *worker = run->executor->workers + thread;
+	const query_t *query = run->queries + index;
+	query_result_t *result = run->results + index;
+
+	result->handles = NULL;
+	result->hit.handle = OCTREE_HANDLE_NONE;
+	result->hit.t = INFINITY;
+	if (query->type == QUERY_RAY) {
+		result->count = octree_find(run->octree, query->ray, &result->hit);
+		return;
+	}
+
+	// the scratch list grows during the walk, so one pass finds every match
+	if (query_region(query, run->octree, &worker->scratch) < 0) {
+		worker->failed = 1;
+		result->count = 0;
+		return;
+	}
+
+	result->count = count = worker->scratch.count;
+	if (count > 0) {
+		if (!(result->handles = arena_alloc(worker->arena, count * sizeof(*result->handles)))) {
+			worker->failed = 1;
+			result->count = 0;
+			return;
+		}
+		memcpy(result->handles, worker->scratch.results, count * sizeof(*result->handles));
+	}
+}
+
+int
+query_executor_run(query_executor_t *executor, octree_t *octree,
+		   const query_t *queries, size_t n, query_result_t *results)
+{
+	int i, failed = 0;
+	query_run_t run = { executor, octree, queries, results };
+
+	query_executor_reset(executor);
+	parallel_steal(n, QUERY_GRAIN, executor->threads, query_run, &run);
+	for (i = 0; i < executor->threads; i++) {
+		failed |= executor->workers[i].failed;
+	}
+	return failed ? -1 : 0;
+}
+
+void
+query_executor_reset(query_executor_t *executor)
+{
+	int i;
+	for (i = 0; i < executor->threads; i++) {
+		arena_reset(executor->workers[i].arena);
+		executor->workers[i].failed = 0;
+	}
+}
+
+void
+query_executor_free(query_executor_t *executor)
+{
+	int i;
+	if (!executor) return;
+	for (i = 0; i < executor->threads; i++) {
+		free(executor->workers[i].scratch.results);
+		arena_free(executor->workers[i].arena);
+	}
+	free(executor);
+}
+
+static double
+query_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int
+query_tune(const aabb_t *boxes, size_t n, const query_t *queries, size_t nqueries,
+	   size_t budget, octree_config_t *config)
+{
+	int i, j, k, status = 0;
+	double best = INFINITY;
+	octree_config_t candidate = *config, chosen = *config;
+	query_executor_t *executor;
+	query_result_t *results;
+
+	executor = query_executor_create(1);
+	results = malloc(nqueries * sizeof(*results));
+	if (!executor || (nqueries > 0 && !results)) {
+		status = -1;
+		goto cleanup;
+	}
+
+	for (i = 0; i < (int) (sizeof(query_tune_depths) / sizeof(*query_tune_depths)); i++) {
+		for (j = 0; j < (int) (sizeof(query_tune_splits) / sizeof(*query_tune_splits)); j++) {
+			double seconds = INFINITY;
+			octree_memory_t memory = {0};
+			octree_t *octree;
+
+			candidate.depth = query_tune_depths[i];
+			candidate.split = query_tune_splits[j];
+			if (!(octree = octree_build_config(boxes, n, &candidate, 0, NULL))) {
+				status = -1;
+				goto cleanup;
+			}
+			octree_memory(octree, &memory);
+			if (budget > 0
+			    && memory.node_bytes + memory.object_bytes + memory.entry_bytes > budget * n) {
+				octree_free(octree);
+				continue;
+			}
+
+			for (k = 0; k < QUERY_TUNE_RUNS && status == 0; k++) {
+				double start = query_now();
+				status = query_executor_run(executor, octree, queries, nqueries, results);
+				seconds = fmin(seconds, query_now() - start);
+			}
+			octree_free(octree);
+			if (status < 0) {
+				goto cleanup;
+			}
+			if (seconds < best) {
+				best = seconds;
+				chosen = candidate;
+			}
+		}
+	}
+
+	if (best == INFINITY) {
+		status = -1;
+	} else {
+		*config = chosen;
+	}
+cleanup:
+	free(results);
+	query_executor_free(executor);
+	return status;
+}
@@ -3,8 +3,41 @@
 ray_t
 ray_create(vec3_t origin, vec3_t direction)
 {
+	int i;
 	ray_t ray;
 	ray.origin = origin;
 	ray.direction = ll_vec3_normalise3fv(direction);
+	for (i = 0; i < 3; i++) {
+		float d = ray.direction.data[i];
+		if (d == 0.0) {
+			ray.inverse.data[i] = INFINITY;
+			ray.sign[i] = 0;
+			continue;
+		}
+		if (fabsf(d) < RAY_EPSILON) {
+			d = copysignf(RAY_EPSILON, d);
+		}
+		ray.inverse.data[i] = 1.0 / d;
+		ray.sign[i] = d < 0.0;
+	}
 	return ray;
 }
+
+int
+ray_packet_create(ray_packet_t *packet, const ray_t *rays, int n)
+{
+	int i, lane;
+	if (n > RAY_PACKET_SIZE) {
+		n = RAY_PACKET_SIZE;
+	}
+
+	for (lane = 0; lane < RAY_PACKET_SIZE; lane++) {
+		const ray_t *ray = rays + (lane < n ? lane : 0);
+		for (i = 0; i < 3; i++) {
+			packet->origin[i][lane] = ray->origin.data[i];
+			packet->inverse[i][lane] = ray->inverse.data[i];
+		}
+		packet->t[lane] = INFINITY;
+	}
+	return (1 << n) - 1;
+}